@@ -12,8 +12,8 @@ Rcpp::Rostream<false>& Rcpp::Rcerr = Rcpp::Rcpp_cerr_get();
 #endif
 
 // lognormal_mixture_gibbs
-arma::cube lognormal_mixture_gibbs(const int& Niter, const int& em_iter, const int& G, const arma::vec& t, const arma::ivec& delta, const arma::mat& X, const arma::vec& starting_seed, const bool& show_output, const int& n_chains, const bool& better_initial_values, const int& N_em, const int& Niter_em, const bool& data_augmentation);
-RcppExport SEXP _lnmixsurv_lognormal_mixture_gibbs(SEXP NiterSEXP, SEXP em_iterSEXP, SEXP GSEXP, SEXP tSEXP, SEXP deltaSEXP, SEXP XSEXP, SEXP starting_seedSEXP, SEXP show_outputSEXP, SEXP n_chainsSEXP, SEXP better_initial_valuesSEXP, SEXP N_emSEXP, SEXP Niter_emSEXP, SEXP data_augmentationSEXP) {
+Rcpp::List lognormal_mixture_gibbs(const int& Niter, const int& em_iter, const int& G, const arma::vec& t, const arma::ivec& delta, SEXP X, long long int starting_seed, const bool& show_output, const int& n_chains, const bool& better_initial_values, const int& N_em, const int& Niter_em, const bool& data_augmentation, const bool& hmc, const bool& within_chain_parallel, const int& warmup, const int& thin, const std::string& draws_file, const bool& early_stopping, const double& rhat_threshold, const double& ess_threshold, const std::string& checkpoint_file, const std::string& resume_from, const std::string& warm_start_from, const bool& single_precision, const Rcpp::CharacterVector& variables);
+RcppExport SEXP _lnmixsurv_lognormal_mixture_gibbs(SEXP NiterSEXP, SEXP em_iterSEXP, SEXP GSEXP, SEXP tSEXP, SEXP deltaSEXP, SEXP XSEXP, SEXP starting_seedSEXP, SEXP show_outputSEXP, SEXP n_chainsSEXP, SEXP better_initial_valuesSEXP, SEXP N_emSEXP, SEXP Niter_emSEXP, SEXP data_augmentationSEXP, SEXP hmcSEXP, SEXP within_chain_parallelSEXP, SEXP warmupSEXP, SEXP thinSEXP, SEXP draws_fileSEXP, SEXP early_stoppingSEXP, SEXP rhat_thresholdSEXP, SEXP ess_thresholdSEXP, SEXP checkpoint_fileSEXP, SEXP resume_fromSEXP, SEXP warm_start_fromSEXP, SEXP single_precisionSEXP, SEXP variablesSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -22,21 +22,34 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const int& >::type G(GSEXP);
     Rcpp::traits::input_parameter< const arma::vec& >::type t(tSEXP);
     Rcpp::traits::input_parameter< const arma::ivec& >::type delta(deltaSEXP);
-    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
-    Rcpp::traits::input_parameter< const arma::vec& >::type starting_seed(starting_seedSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type X(XSEXP);
+    Rcpp::traits::input_parameter< long long int >::type starting_seed(starting_seedSEXP);
     Rcpp::traits::input_parameter< const bool& >::type show_output(show_outputSEXP);
     Rcpp::traits::input_parameter< const int& >::type n_chains(n_chainsSEXP);
     Rcpp::traits::input_parameter< const bool& >::type better_initial_values(better_initial_valuesSEXP);
     Rcpp::traits::input_parameter< const int& >::type N_em(N_emSEXP);
     Rcpp::traits::input_parameter< const int& >::type Niter_em(Niter_emSEXP);
     Rcpp::traits::input_parameter< const bool& >::type data_augmentation(data_augmentationSEXP);
-    rcpp_result_gen = Rcpp::wrap(lognormal_mixture_gibbs(Niter, em_iter, G, t, delta, X, starting_seed, show_output, n_chains, better_initial_values, N_em, Niter_em, data_augmentation));
+    Rcpp::traits::input_parameter< const bool& >::type hmc(hmcSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type within_chain_parallel(within_chain_parallelSEXP);
+    Rcpp::traits::input_parameter< const int& >::type warmup(warmupSEXP);
+    Rcpp::traits::input_parameter< const int& >::type thin(thinSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type draws_file(draws_fileSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type early_stopping(early_stoppingSEXP);
+    Rcpp::traits::input_parameter< const double& >::type rhat_threshold(rhat_thresholdSEXP);
+    Rcpp::traits::input_parameter< const double& >::type ess_threshold(ess_thresholdSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type checkpoint_file(checkpoint_fileSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type resume_from(resume_fromSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type warm_start_from(warm_start_fromSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type single_precision(single_precisionSEXP);
+    Rcpp::traits::input_parameter< const Rcpp::CharacterVector& >::type variables(variablesSEXP);
+    rcpp_result_gen = Rcpp::wrap(lognormal_mixture_gibbs(Niter, em_iter, G, t, delta, X, starting_seed, show_output, n_chains, better_initial_values, N_em, Niter_em, data_augmentation, hmc, within_chain_parallel, warmup, thin, draws_file, early_stopping, rhat_threshold, ess_threshold, checkpoint_file, resume_from, warm_start_from, single_precision, variables));
     return rcpp_result_gen;
 END_RCPP
 }
 // lognormal_mixture_em_implementation
-arma::field<arma::mat> lognormal_mixture_em_implementation(const int& Niter, const int& G, const arma::vec& t, const arma::ivec& delta, const arma::mat& X, long long int starting_seed, const bool& better_initial_values, const int& N_em, const int& Niter_em, const bool& show_output);
-RcppExport SEXP _lnmixsurv_lognormal_mixture_em_implementation(SEXP NiterSEXP, SEXP GSEXP, SEXP tSEXP, SEXP deltaSEXP, SEXP XSEXP, SEXP starting_seedSEXP, SEXP better_initial_valuesSEXP, SEXP N_emSEXP, SEXP Niter_emSEXP, SEXP show_outputSEXP) {
+arma::field<arma::mat> lognormal_mixture_em_implementation(const int& Niter, const int& G, const arma::vec& t, const arma::ivec& delta, SEXP X, long long int starting_seed, const bool& better_initial_values, const int& N_em, const int& Niter_em, const bool& show_output, const int& batch_size, const double& tol, const bool& squarem, const arma::vec& eta_start, const arma::mat& beta_start, const arma::vec& phi_start);
+RcppExport SEXP _lnmixsurv_lognormal_mixture_em_implementation(SEXP NiterSEXP, SEXP GSEXP, SEXP tSEXP, SEXP deltaSEXP, SEXP XSEXP, SEXP starting_seedSEXP, SEXP better_initial_valuesSEXP, SEXP N_emSEXP, SEXP Niter_emSEXP, SEXP show_outputSEXP, SEXP batch_sizeSEXP, SEXP tolSEXP, SEXP squaremSEXP, SEXP eta_startSEXP, SEXP beta_startSEXP, SEXP phi_startSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -44,13 +57,41 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const int& >::type G(GSEXP);
     Rcpp::traits::input_parameter< const arma::vec& >::type t(tSEXP);
     Rcpp::traits::input_parameter< const arma::ivec& >::type delta(deltaSEXP);
-    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type X(XSEXP);
     Rcpp::traits::input_parameter< long long int >::type starting_seed(starting_seedSEXP);
     Rcpp::traits::input_parameter< const bool& >::type better_initial_values(better_initial_valuesSEXP);
     Rcpp::traits::input_parameter< const int& >::type N_em(N_emSEXP);
     Rcpp::traits::input_parameter< const int& >::type Niter_em(Niter_emSEXP);
     Rcpp::traits::input_parameter< const bool& >::type show_output(show_outputSEXP);
-    rcpp_result_gen = Rcpp::wrap(lognormal_mixture_em_implementation(Niter, G, t, delta, X, starting_seed, better_initial_values, N_em, Niter_em, show_output));
+    Rcpp::traits::input_parameter< const int& >::type batch_size(batch_sizeSEXP);
+    Rcpp::traits::input_parameter< const double& >::type tol(tolSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type squarem(squaremSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type eta_start(eta_startSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type beta_start(beta_startSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type phi_start(phi_startSEXP);
+    rcpp_result_gen = Rcpp::wrap(lognormal_mixture_em_implementation(Niter, G, t, delta, X, starting_seed, better_initial_values, N_em, Niter_em, show_output, batch_size, tol, squarem, eta_start, beta_start, phi_start));
+    return rcpp_result_gen;
+END_RCPP
+}
+// normal_math_cpp
+arma::mat normal_math_cpp(const arma::vec& z);
+RcppExport SEXP _lnmixsurv_normal_math_cpp(SEXP zSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::vec& >::type z(zSEXP);
+    rcpp_result_gen = Rcpp::wrap(normal_math_cpp(z));
+    return rcpp_result_gen;
+END_RCPP
+}
+// normal_quantile_cpp
+arma::vec normal_quantile_cpp(const arma::vec& p);
+RcppExport SEXP _lnmixsurv_normal_quantile_cpp(SEXP pSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::vec& >::type p(pSEXP);
+    rcpp_result_gen = Rcpp::wrap(normal_quantile_cpp(p));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -84,37 +125,22 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
-// predict_survival_gibbs_cpp
-arma::mat predict_survival_gibbs_cpp(const arma::vec& eval_time, const arma::rowvec& predictors, const arma::field<arma::mat>& beta_start, const arma::mat sigma_start, const arma::mat eta_start, const bool& interval, const double& level);
-RcppExport SEXP _lnmixsurv_predict_survival_gibbs_cpp(SEXP eval_timeSEXP, SEXP predictorsSEXP, SEXP beta_startSEXP, SEXP sigma_startSEXP, SEXP eta_startSEXP, SEXP intervalSEXP, SEXP levelSEXP) {
-BEGIN_RCPP
-    Rcpp::RObject rcpp_result_gen;
-    Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< const arma::vec& >::type eval_time(eval_timeSEXP);
-    Rcpp::traits::input_parameter< const arma::rowvec& >::type predictors(predictorsSEXP);
-    Rcpp::traits::input_parameter< const arma::field<arma::mat>& >::type beta_start(beta_startSEXP);
-    Rcpp::traits::input_parameter< const arma::mat >::type sigma_start(sigma_startSEXP);
-    Rcpp::traits::input_parameter< const arma::mat >::type eta_start(eta_startSEXP);
-    Rcpp::traits::input_parameter< const bool& >::type interval(intervalSEXP);
-    Rcpp::traits::input_parameter< const double& >::type level(levelSEXP);
-    rcpp_result_gen = Rcpp::wrap(predict_survival_gibbs_cpp(eval_time, predictors, beta_start, sigma_start, eta_start, interval, level));
-    return rcpp_result_gen;
-END_RCPP
-}
-// predict_hazard_gibbs_cpp
-arma::mat predict_hazard_gibbs_cpp(const arma::vec& eval_time, const arma::rowvec& predictors, const arma::field<arma::mat>& beta_start, const arma::mat sigma_start, const arma::mat eta_start, const bool& interval, const double& level);
-RcppExport SEXP _lnmixsurv_predict_hazard_gibbs_cpp(SEXP eval_timeSEXP, SEXP predictorsSEXP, SEXP beta_startSEXP, SEXP sigma_startSEXP, SEXP eta_startSEXP, SEXP intervalSEXP, SEXP levelSEXP) {
+// predict_gibbs_cpp
+arma::cube predict_gibbs_cpp(const arma::vec& eval_time, SEXP predictors, const arma::field<arma::mat>& beta, const arma::mat& sigma, const arma::mat& eta, const bool& hazard, const bool& interval, const double& level, const bool& streaming);
+RcppExport SEXP _lnmixsurv_predict_gibbs_cpp(SEXP eval_timeSEXP, SEXP predictorsSEXP, SEXP betaSEXP, SEXP sigmaSEXP, SEXP etaSEXP, SEXP hazardSEXP, SEXP intervalSEXP, SEXP levelSEXP, SEXP streamingSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< const arma::vec& >::type eval_time(eval_timeSEXP);
-    Rcpp::traits::input_parameter< const arma::rowvec& >::type predictors(predictorsSEXP);
-    Rcpp::traits::input_parameter< const arma::field<arma::mat>& >::type beta_start(beta_startSEXP);
-    Rcpp::traits::input_parameter< const arma::mat >::type sigma_start(sigma_startSEXP);
-    Rcpp::traits::input_parameter< const arma::mat >::type eta_start(eta_startSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type predictors(predictorsSEXP);
+    Rcpp::traits::input_parameter< const arma::field<arma::mat>& >::type beta(betaSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type sigma(sigmaSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type eta(etaSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type hazard(hazardSEXP);
     Rcpp::traits::input_parameter< const bool& >::type interval(intervalSEXP);
     Rcpp::traits::input_parameter< const double& >::type level(levelSEXP);
-    rcpp_result_gen = Rcpp::wrap(predict_hazard_gibbs_cpp(eval_time, predictors, beta_start, sigma_start, eta_start, interval, level));
+    Rcpp::traits::input_parameter< const bool& >::type streaming(streamingSEXP);
+    rcpp_result_gen = Rcpp::wrap(predict_gibbs_cpp(eval_time, predictors, beta, sigma, eta, hazard, interval, level, streaming));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -136,12 +162,13 @@ END_RCPP
 }
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_lnmixsurv_lognormal_mixture_gibbs", (DL_FUNC) &_lnmixsurv_lognormal_mixture_gibbs, 13},
-    {"_lnmixsurv_lognormal_mixture_em_implementation", (DL_FUNC) &_lnmixsurv_lognormal_mixture_em_implementation, 10},
+    {"_lnmixsurv_lognormal_mixture_gibbs", (DL_FUNC) &_lnmixsurv_lognormal_mixture_gibbs, 26},
+    {"_lnmixsurv_lognormal_mixture_em_implementation", (DL_FUNC) &_lnmixsurv_lognormal_mixture_em_implementation, 16},
+    {"_lnmixsurv_normal_math_cpp", (DL_FUNC) &_lnmixsurv_normal_math_cpp, 1},
+    {"_lnmixsurv_normal_quantile_cpp", (DL_FUNC) &_lnmixsurv_normal_quantile_cpp, 1},
     {"_lnmixsurv_predict_survival_em_cpp", (DL_FUNC) &_lnmixsurv_predict_survival_em_cpp, 5},
     {"_lnmixsurv_predict_hazard_em_cpp", (DL_FUNC) &_lnmixsurv_predict_hazard_em_cpp, 5},
-    {"_lnmixsurv_predict_survival_gibbs_cpp", (DL_FUNC) &_lnmixsurv_predict_survival_gibbs_cpp, 7},
-    {"_lnmixsurv_predict_hazard_gibbs_cpp", (DL_FUNC) &_lnmixsurv_predict_hazard_gibbs_cpp, 7},
+    {"_lnmixsurv_predict_gibbs_cpp", (DL_FUNC) &_lnmixsurv_predict_gibbs_cpp, 9},
     {"_lnmixsurv_simulate_y", (DL_FUNC) &_lnmixsurv_simulate_y, 6},
     {NULL, NULL, 0}
 };
@@ -0,0 +1,153 @@
+#include "chain_state.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+// Identifies the format of the checkpoint files (and its version)
+const char CHECKPOINT_MAGIC[8] = {'L', 'N', 'M', 'X', 'C', 'K', 'P', '3'};
+
+// The file is a header followed by the state of each chain, every value stored
+// with the byte order of the machine (checkpoints are meant to be resumed
+// where they were made).
+void write_values(std::FILE* file, const void* data, const std::size_t& size, const std::size_t& n) {
+  if (n > 0 && std::fwrite(data, size, n, file) != n) {
+    std::fclose(file);
+    Rcpp::stop("Could not write the checkpoint file.");
+  }
+}
+
+void read_values(std::FILE* file, void* data, const std::size_t& size, const std::size_t& n) {
+  if (n > 0 && std::fread(data, size, n, file) != n) {
+    std::fclose(file);
+    Rcpp::stop("The checkpoint file is truncated or corrupted.");
+  }
+}
+
+void save_checkpoint(const std::string& path, const CheckpointHeader& header,
+                     const std::vector<ChainState>& states) {
+  std::FILE* file = std::fopen(path.c_str(), "wb");
+
+  if (file == NULL) {
+    Rcpp::stop("Could not create the checkpoint file " + path);
+  }
+
+  write_values(file, CHECKPOINT_MAGIC, 1, sizeof(CHECKPOINT_MAGIC));
+  write_values(file, &header, sizeof(CheckpointHeader), 1);
+
+  for (std::size_t c = 0; c < states.size(); c++) {
+    const ChainState& s = states[c];
+
+    write_values(file, &s.iterations, sizeof(int), 1);
+    write_values(file, s.rng, sizeof(uint32_t), Philox4x32::state_size);
+    write_values(file, s.eta.memptr(), sizeof(double), s.eta.n_elem);
+    write_values(file, s.phi.memptr(), sizeof(double), s.phi.n_elem);
+    write_values(file, s.beta.memptr(), sizeof(double), s.beta.n_elem);
+    write_values(file, s.groups.memptr(), sizeof(arma::sword), s.groups.n_elem);
+    write_values(file, s.y_censored.memptr(), sizeof(double), s.y_censored.n_elem);
+    write_values(file, s.XtX.memptr(), sizeof(double), s.XtX.n_elem);
+    write_values(file, s.Xty.memptr(), sizeof(double), s.Xty.n_elem);
+    write_values(file, s.yty.memptr(), sizeof(double), s.yty.n_elem);
+    write_values(file, s.proposal_var_phi.memptr(), sizeof(double), s.proposal_var_phi.n_elem);
+    write_values(file, s.adapt_rate_phi.memptr(), sizeof(double), s.adapt_rate_phi.n_elem);
+    write_values(file, s.proposal_var_beta.memptr(), sizeof(double), s.proposal_var_beta.n_elem);
+    write_values(file, s.adapt_rate_beta.memptr(), sizeof(double), s.adapt_rate_beta.n_elem);
+    write_values(file, s.hmc_step_size.memptr(), sizeof(double), s.hmc_step_size.n_elem);
+    write_values(file, s.hmc_phi_scale.memptr(), sizeof(double), s.hmc_phi_scale.n_elem);
+    write_values(file, &s.relabel_count, sizeof(int), 1);
+    write_values(file, s.relabel_mean.memptr(), sizeof(double), s.relabel_mean.n_elem);
+    write_values(file, s.relabel_m2.memptr(), sizeof(double), s.relabel_m2.n_elem);
+  }
+
+  if (std::fclose(file) != 0) {
+    Rcpp::stop("Could not write the checkpoint file " + path);
+  }
+}
+
+void load_checkpoint(const std::string& path, CheckpointHeader& expected,
+                     std::vector<ChainState>& states, const bool& warm_start) {
+  std::FILE* file = std::fopen(path.c_str(), "rb");
+  char magic[sizeof(CHECKPOINT_MAGIC)];
+  CheckpointHeader header;
+
+  if (file == NULL) {
+    Rcpp::stop("Could not open the checkpoint file " + path);
+  }
+
+  read_values(file, magic, 1, sizeof(magic));
+
+  if (std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0) {
+    std::fclose(file);
+    Rcpp::stop(path + " is not a checkpoint file.");
+  }
+
+  read_values(file, &header, sizeof(CheckpointHeader), 1);
+
+  if (header.n_chains != expected.n_chains || header.G != expected.G || header.p != expected.p) {
+    std::fclose(file);
+    Rcpp::stop("The checkpoint doesn't match the number of chains, mixture components or predictors.");
+  }
+
+  if (warm_start) {
+    if (header.N > expected.N) {
+      std::fclose(file);
+      Rcpp::stop("The checkpoint has more observations than the data.");
+    }
+  } else {
+    if (header.N != expected.N || header.n_censored != expected.n_censored ||
+        header.data_augmentation != expected.data_augmentation || header.hmc != expected.hmc ||
+        header.single_precision != expected.single_precision) {
+      std::fclose(file);
+      Rcpp::stop("The checkpoint doesn't match the data or the sampler.");
+    }
+
+    expected.warmup = header.warmup;
+    expected.thin = header.thin;
+  }
+
+  int G = header.G;
+  int p = header.p;
+  states.resize(header.n_chains);
+
+  for (int c = 0; c < header.n_chains; c++) {
+    ChainState& s = states[c];
+
+    s.eta.set_size(G);
+    s.phi.set_size(G);
+    s.beta.set_size(G, p);
+    s.groups.set_size(header.N);
+    s.y_censored.set_size(header.n_censored);
+    s.XtX.set_size(p, p, G);
+    s.Xty.set_size(p, G);
+    s.yty.set_size(G);
+    s.proposal_var_phi.set_size(G);
+    s.adapt_rate_phi.set_size(G);
+    s.proposal_var_beta.set_size(G);
+    s.adapt_rate_beta.set_size(G);
+    s.hmc_step_size.set_size(G);
+    s.hmc_phi_scale.set_size(G);
+    s.relabel_mean.set_size(p + 2, G);
+    s.relabel_m2.set_size(p + 2, G);
+
+    read_values(file, &s.iterations, sizeof(int), 1);
+    read_values(file, s.rng, sizeof(uint32_t), Philox4x32::state_size);
+    read_values(file, s.eta.memptr(), sizeof(double), s.eta.n_elem);
+    read_values(file, s.phi.memptr(), sizeof(double), s.phi.n_elem);
+    read_values(file, s.beta.memptr(), sizeof(double), s.beta.n_elem);
+    read_values(file, s.groups.memptr(), sizeof(arma::sword), s.groups.n_elem);
+    read_values(file, s.y_censored.memptr(), sizeof(double), s.y_censored.n_elem);
+    read_values(file, s.XtX.memptr(), sizeof(double), s.XtX.n_elem);
+    read_values(file, s.Xty.memptr(), sizeof(double), s.Xty.n_elem);
+    read_values(file, s.yty.memptr(), sizeof(double), s.yty.n_elem);
+    read_values(file, s.proposal_var_phi.memptr(), sizeof(double), s.proposal_var_phi.n_elem);
+    read_values(file, s.adapt_rate_phi.memptr(), sizeof(double), s.adapt_rate_phi.n_elem);
+    read_values(file, s.proposal_var_beta.memptr(), sizeof(double), s.proposal_var_beta.n_elem);
+    read_values(file, s.adapt_rate_beta.memptr(), sizeof(double), s.adapt_rate_beta.n_elem);
+    read_values(file, s.hmc_step_size.memptr(), sizeof(double), s.hmc_step_size.n_elem);
+    read_values(file, s.hmc_phi_scale.memptr(), sizeof(double), s.hmc_phi_scale.n_elem);
+    read_values(file, &s.relabel_count, sizeof(int), 1);
+    read_values(file, s.relabel_mean.memptr(), sizeof(double), s.relabel_mean.n_elem);
+    read_values(file, s.relabel_m2.memptr(), sizeof(double), s.relabel_m2.n_elem);
+  }
+
+  std::fclose(file);
+}
@@ -0,0 +1,62 @@
+#ifndef CHAIN_STATE_HPP
+#define CHAIN_STATE_HPP
+
+#include <RcppArmadillo.h>
+#include <string>
+#include <vector>
+
+#include "rng_utils.hpp"
+
+// Everything a Gibbs chain needs to continue sampling exactly as if it had
+// never stopped: the generator, the parameters, the latent groups and
+// censored times, the statistics of the augmented data (which are updated
+// incrementally, so rebuilding them would change the last bits) and the
+// adaptive proposals.
+struct ChainState {
+  int iterations; // number of iterations already done
+  uint32_t rng[Philox4x32::state_size];
+  arma::vec eta;
+  arma::vec phi;
+  arma::mat beta;
+  arma::ivec groups;
+  arma::vec y_censored; // augmented log-times of the censored observations
+  arma::cube XtX;
+  arma::mat Xty;
+  arma::vec yty;
+  arma::vec proposal_var_phi;
+  arma::vec adapt_rate_phi;
+  arma::vec proposal_var_beta;
+  arma::vec adapt_rate_beta;
+  arma::vec hmc_step_size;
+  arma::vec hmc_phi_scale;
+  arma::mat relabel_mean; // running moments of the relabelled components
+  arma::mat relabel_m2;
+  int relabel_count;
+};
+
+// Settings of the run that produced the states, which a resumed run must share
+struct CheckpointHeader {
+  int n_chains;
+  int G;
+  int p;
+  int N;
+  int n_censored;
+  int warmup;
+  int thin;
+  int data_augmentation;
+  int hmc;
+  int single_precision;
+};
+
+// Writes the states of all chains to a binary file at path
+void save_checkpoint(const std::string& path, const CheckpointHeader& header,
+                     const std::vector<ChainState>& states);
+
+// Reads the states written by save_checkpoint, checking that the data
+// dimensions match the ones in expected (warmup and thin are read, not checked).
+// For a warm start, the checkpoint may have fewer observations (the first rows
+// of the new data) and warmup and thin are kept.
+void load_checkpoint(const std::string& path, CheckpointHeader& expected,
+                     std::vector<ChainState>& states, const bool& warm_start);
+
+#endif
@@ -0,0 +1,248 @@
+#include "convergence_monitor.hpp"
+#include "normal_math.hpp"
+
+// Replaces the values of x (all the split chains of a quantity together) by the
+// normal scores of their ranks, with ties getting their average rank
+arma::mat rank_normalize(const arma::mat& x) {
+  int S = x.n_elem;
+  arma::uvec order = arma::sort_index(arma::vectorise(x));
+  arma::mat z(x.n_rows, x.n_cols);
+  int first = 0;
+
+  while (first < S) {
+    int last = first;
+
+    while (last + 1 < S && x(order(last + 1)) == x(order(first))) {
+      last++;
+    }
+
+    double rank = (first + last) / 2.0 + 1.0;
+    double score = normal_quantile((rank - 3.0 / 8.0) / (S + 1.0 / 4.0));
+
+    for (int i = first; i <= last; i++) {
+      z(order(i)) = score;
+    }
+
+    first = last + 1;
+  }
+
+  return z;
+}
+
+// Autocovariances (divided by n) of the column x for lags 0, ..., n - 1,
+// computed with the FFT of the series padded with zeros
+arma::vec autocovariance(const arma::vec& x) {
+  int n = x.n_elem;
+  arma::vec centered = arma::zeros(2 * n);
+  centered.head(n) = x - arma::mean(x);
+
+  arma::cx_vec f = arma::fft(centered);
+  arma::vec acov = arma::real(arma::ifft(f % arma::conj(f)));
+
+  return acov.head(n) / n;
+}
+
+// Split R-hat of the chains (columns) of x
+double split_rhat(const arma::mat& x) {
+  int n = x.n_rows;
+  double W = arma::mean(arma::var(x));
+  double B_n = arma::var(arma::mean(x).t());
+  double var_plus = (n - 1.0) / n * W + B_n;
+
+  return std::sqrt(var_plus / W);
+}
+
+// Effective sample size of the chains (columns) of x, with Geyer's initial
+// monotone sequence estimator of the autocorrelation time (as in Stan)
+double chains_ess(const arma::mat& x) {
+  int n = x.n_rows;
+  int M = x.n_cols;
+  arma::mat acov(n, M);
+
+  for (int m = 0; m < M; m++) {
+    acov.col(m) = autocovariance(x.col(m));
+  }
+
+  double mean_var = arma::mean(acov.row(0)) * n / (n - 1.0);
+  double var_plus = mean_var * (n - 1.0) / n;
+
+  if (M > 1) {
+    var_plus += arma::var(arma::mean(x).t());
+  }
+
+  arma::vec rho_hat(n, arma::fill::zeros);
+  double rho_hat_even = 1.0;
+  double rho_hat_odd = 1.0 - (mean_var - arma::mean(acov.row(1))) / var_plus;
+  rho_hat(0) = rho_hat_even;
+  rho_hat(1) = rho_hat_odd;
+
+  int s = 1;
+
+  while (s < n - 4 && rho_hat_even + rho_hat_odd > 0.0) {
+    rho_hat_even = 1.0 - (mean_var - arma::mean(acov.row(s + 1))) / var_plus;
+    rho_hat_odd = 1.0 - (mean_var - arma::mean(acov.row(s + 2))) / var_plus;
+
+    if (rho_hat_even + rho_hat_odd >= 0.0) {
+      rho_hat(s + 1) = rho_hat_even;
+      rho_hat(s + 2) = rho_hat_odd;
+    }
+
+    s += 2;
+  }
+
+  int max_s = s;
+
+  if (rho_hat_even > 0.0) {
+    rho_hat(max_s + 1) = rho_hat_even;
+  }
+
+  // initial positive sequence to initial monotone sequence
+  for (int j = 1; j <= max_s - 3; j += 2) {
+    if (rho_hat(j + 1) + rho_hat(j + 2) > rho_hat(j - 1) + rho_hat(j)) {
+      rho_hat(j + 1) = (rho_hat(j - 1) + rho_hat(j)) / 2.0;
+      rho_hat(j + 2) = rho_hat(j + 1);
+    }
+  }
+
+  double total = static_cast<double>(n) * M;
+  double tau_hat = -1.0 + 2.0 * arma::accu(rho_hat.head(max_s)) + rho_hat(max_s + 1);
+
+  return std::min(total / tau_hat, total * std::log10(total));
+}
+
+ConvergenceMonitor::ConvergenceMonitor(const bool& enabled, const int& n_chains, const int& G, const int& n_params, const int& max_draws,
+                                       const int& check_every, const double& rhat_threshold, const double& ess_threshold) :
+  active(enabled), chains(n_chains), G(G), n_params(n_params), max_draws(max_draws), check_every(check_every),
+  rhat_threshold(rhat_threshold), ess_threshold(ess_threshold),
+  orders(enabled ? n_chains : 0), recorded(n_chains), stop_at(max_draws), next_checkpoint(check_every),
+  converged(false), evaluating(false),
+  rhat_(G * n_params, arma::fill::value(arma::datum::nan)), ess_(G * n_params, arma::fill::value(arma::datum::nan)) {
+  for (int c = 0; c < static_cast<int>(orders.size()); c++) {
+    orders[c].resize(static_cast<std::size_t>(max_draws) * G);
+  }
+}
+
+void ConvergenceMonitor::record(const int& chain, const arma::uvec& order) {
+  if (!active) {
+    return;
+  }
+
+  int n = recorded[chain].load();
+
+  if (n >= max_draws) {
+    return;
+  }
+
+  std::copy(order.begin(), order.end(), orders[chain].begin() + static_cast<std::size_t>(n) * G);
+  recorded[chain].store(n + 1);
+
+  if ((n + 1) % check_every == 0) {
+    evaluate_checkpoints();
+  }
+}
+
+void ConvergenceMonitor::evaluate_checkpoints() {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  // the thread already evaluating also evaluates the checkpoints reached meanwhile
+  if (evaluating) {
+    return;
+  }
+
+  evaluating = true;
+  arma::vec rhat(G * n_params);
+  arma::vec ess(G * n_params);
+
+  while (!converged && next_checkpoint < max_draws) {
+    for (int c = 0; c < chains; c++) {
+      if (recorded[c].load() < next_checkpoint) {
+        evaluating = false;
+        return;
+      }
+    }
+
+    // the draws up to the checkpoint don't change anymore
+    int n = next_checkpoint;
+    lock.unlock();
+    diagnostics(n, rhat, ess);
+    lock.lock();
+
+    rhat_ = rhat;
+    ess_ = ess;
+
+    if (rhat_.is_finite() && ess_.is_finite() &&
+        rhat_.max() < rhat_threshold && ess_.min() >= ess_threshold) {
+      converged = true;
+      stop_at.store(next_checkpoint);
+    } else {
+      next_checkpoint += check_every;
+    }
+  }
+
+  evaluating = false;
+}
+
+bool ConvergenceMonitor::keep_sampling(const int& chain) const {
+  return !active || recorded[chain].load() < stop_at.load();
+}
+
+bool ConvergenceMonitor::may_stop_at(const int& n) {
+  if (!active || n % check_every != 0 || n >= max_draws) {
+    return false;
+  }
+
+  return n >= open_checkpoint();
+}
+
+int ConvergenceMonitor::open_checkpoint() {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  return next_checkpoint;
+}
+
+void ConvergenceMonitor::finish() {
+  if (active && !converged) {
+    diagnostics(max_draws, rhat_, ess_);
+  }
+}
+
+void ConvergenceMonitor::diagnostics(const int& n, arma::vec& rhat, arma::vec& ess) const {
+  int half = n / 2;
+
+  if (half < 4) {
+    rhat.fill(arma::datum::nan);
+    ess.fill(arma::datum::nan);
+    return;
+  }
+
+  arma::cube values(n, G, chains); // one parameter of every label of each chain
+  arma::mat x(half, 2 * chains);
+
+  for (int q = 0; q < n_params; q++) {
+    for (int c = 0; c < chains; c++) {
+      for (int label = 0; label < G; label++) {
+        reader(c, label * n_params + q, n, values.slice(c).colptr(label));
+      }
+    }
+
+    // the parameter of the component with the g-th largest eta in each draw
+    for (int g = 0; g < G; g++) {
+      // splitting each chain in two halves (the middle draw is dropped if n is odd)
+      for (int c = 0; c < chains; c++) {
+        const arma::uword* chain_orders = orders[c].data();
+
+        for (int i = 0; i < half; i++) {
+          int second = n - half + i;
+
+          x(i, 2 * c) = values(i, chain_orders[static_cast<std::size_t>(i) * G + g], c);
+          x(i, 2 * c + 1) = values(second, chain_orders[static_cast<std::size_t>(second) * G + g], c);
+        }
+      }
+
+      arma::mat z = rank_normalize(x);
+
+      rhat(g * n_params + q) = split_rhat(z);
+      ess(g * n_params + q) = chains_ess(z);
+    }
+  }
+}
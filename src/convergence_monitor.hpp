@@ -0,0 +1,96 @@
+#ifndef CONVERGENCE_MONITOR_HPP
+#define CONVERGENCE_MONITOR_HPP
+
+#include <RcppArmadillo.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Reads, as double, the first n draws of the column col (in the order of the
+// relabelled draws of the sampler: G blocks of n_params values) of a chain on out
+typedef std::function<void(const int& chain, const int& col, const int& n, double* out)> DrawReader;
+
+// Online convergence diagnostics across chains running concurrently. Every
+// check_every retained draws (a checkpoint), once all the chains have reached
+// it, the rank-normalized split R-hat and the bulk effective sample size
+// (Vehtari et al., 2021) of each monitored quantity are computed on the draws
+// up to the checkpoint. The monitored quantities are the parameters of the
+// components ordered by decreasing eta in each draw, so the diagnostics don't
+// suffer from label switching (between chains, either). When max R-hat <
+// rhat_threshold and min ESS >= ess_threshold, every chain stops at that
+// checkpoint. The checkpoints are evaluated in order and only on their common
+// prefix of draws, so where the chains stop doesn't depend on how fast each
+// one of them runs. A fast chain may sample past the checkpoint where they
+// stop before it's evaluated, so the caller keeps the state of each chain at
+// the checkpoints that may still stop it (may_stop_at) and rolls the chain
+// back to the one where they stop.
+// The monitor only keeps the order of the components of each draw; their
+// values are read from where the draws are stored (reader), where each chain
+// must have written its draws up to a checkpoint before recording its last
+// one. The diagnostics are computed by the thread of the last chain to reach
+// the checkpoint, outside the lock, so the other chains keep running.
+class ConvergenceMonitor {
+public:
+  ConvergenceMonitor(const bool& enabled, const int& n_chains, const int& G, const int& n_params, const int& max_draws,
+                     const int& check_every, const double& rhat_threshold, const double& ess_threshold);
+
+  bool enabled() const { return active; }
+
+  // Sets where the values of the draws are read from, before the chains run
+  void read_draws_from(const DrawReader& draw_reader) { reader = draw_reader; }
+
+  // Appends the next draw of the chain, given by the order of its components
+  // (the labels sorted by decreasing eta)
+  void record(const int& chain, const arma::uvec& order);
+
+  // False once the chain has all the draws it needs
+  bool keep_sampling(const int& chain) const;
+
+  // True if the chains may still stop after their n-th draw (a checkpoint
+  // not evaluated yet, or the one where they stop)
+  bool may_stop_at(const int& n);
+
+  // First checkpoint where the chains may still stop: they don't stop at the
+  // ones before it
+  int open_checkpoint();
+
+  // Number of draws kept by each chain, after all of them finished
+  int n_draws() const { return stop_at.load(); }
+
+  // Computes the diagnostics on all the draws, if no checkpoint stopped the chains
+  void finish();
+
+  const arma::vec& rhat() const { return rhat_; }
+  const arma::vec& ess() const { return ess_; }
+
+private:
+  bool active;
+  int chains;
+  int G;
+  int n_params;
+  int max_draws;
+  int check_every;
+  double rhat_threshold;
+  double ess_threshold;
+  DrawReader reader;
+
+  std::vector<std::vector<arma::uword> > orders; // order of the components of each draw of each chain (preallocated)
+  std::vector<std::atomic<int> > recorded; // number of draws recorded by each chain
+  std::atomic<int> stop_at;
+  int next_checkpoint;
+  bool converged;
+  bool evaluating; // a thread is evaluating the checkpoints
+  std::mutex mutex;
+
+  arma::vec rhat_;
+  arma::vec ess_;
+
+  // Evaluates, in order, every checkpoint all the chains have reached
+  void evaluate_checkpoints();
+
+  // Diagnostics of all the monitored quantities using the first n draws of each chain
+  void diagnostics(const int& n, arma::vec& rhat, arma::vec& ess) const;
+};
+
+#endif
@@ -0,0 +1,63 @@
+#include "design_matrix.hpp"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+arma::mat design_rows(const arma::mat& X, const arma::uvec& rows) {
+  return X.rows(rows);
+}
+
+// Gathers the nonzero entries of the selected rows column by column, straight
+// into the compressed sparse column arrays of the result
+arma::sp_mat design_rows(const arma::sp_mat& X, const arma::uvec& rows) {
+  arma::uword n = rows.n_elem;
+  arma::uvec position(X.n_rows);
+  arma::uvec col_ptrs(X.n_cols + 1);
+  std::vector<std::pair<arma::uword, double> > entries;
+  bool sorted = rows.is_sorted();
+
+  position.fill(n); // rows not selected
+
+  for (arma::uword j = 0; j < n; j++) {
+    position(rows(j)) = j;
+  }
+
+  X.sync();
+  col_ptrs(0) = 0;
+
+  for (arma::uword c = 0; c < X.n_cols; c++) {
+    std::size_t first = entries.size();
+
+    for (arma::uword a = X.col_ptrs[c]; a < X.col_ptrs[c + 1]; a++) {
+      if (position(X.row_indices[a]) < n) {
+        entries.emplace_back(position(X.row_indices[a]), X.values[a]);
+      }
+    }
+
+    // the row indices of each column must be increasing
+    if (!sorted) {
+      std::sort(entries.begin() + first, entries.end());
+    }
+
+    col_ptrs(c + 1) = entries.size();
+  }
+
+  arma::uvec row_indices(entries.size());
+  arma::vec values(entries.size());
+
+  for (std::size_t a = 0; a < entries.size(); a++) {
+    row_indices(a) = entries[a].first;
+    values(a) = entries[a].second;
+  }
+
+  return arma::sp_mat(row_indices, col_ptrs, values, n, X.n_cols);
+}
+
+void DesignRows<arma::sp_mat>::read(const arma::uword& i, arma::rowvec& out) const {
+  out.zeros(Xt.n_rows);
+
+  for (arma::uword a = Xt.col_ptrs[i]; a < Xt.col_ptrs[i + 1]; a++) {
+    out(Xt.row_indices[a]) = Xt.values[a];
+  }
+}
@@ -0,0 +1,78 @@
+#ifndef DESIGN_MATRIX_HPP
+#define DESIGN_MATRIX_HPP
+
+#include <RcppArmadillo.h>
+
+// The design matrix reaches the samplers either dense (arma::mat) or sparse
+// (arma::sp_mat, from a dgCMatrix), e.g. when it has many indicator columns.
+// The samplers are templates on its type and these are the operations whose
+// Armadillo syntax differs between the two.
+
+// Rows of X in the given order (each row of X at most once)
+arma::mat design_rows(const arma::mat& X, const arma::uvec& rows);
+arma::sp_mat design_rows(const arma::sp_mat& X, const arma::uvec& rows);
+
+// Reads the rows of X one at a time, always dense. A dense X is read in
+// place; a sparse one is transposed once, so each of its rows is a column of
+// the compressed X' and is read in time proportional to its nonzero entries
+// (instead of searching every column of X).
+template <typename MatType>
+class DesignRows;
+
+template <>
+class DesignRows<arma::mat> {
+public:
+  explicit DesignRows(const arma::mat& X) : X(X) {}
+
+  arma::uword n_rows() const { return X.n_rows; }
+  arma::uword n_cols() const { return X.n_cols; }
+
+  // Writes the row i of X on out
+  void read(const arma::uword& i, arma::rowvec& out) const { out = X.row(i); }
+
+private:
+  const arma::mat& X;
+};
+
+template <>
+class DesignRows<arma::sp_mat> {
+public:
+  explicit DesignRows(const arma::sp_mat& X) : Xt(X.t()) {}
+
+  arma::uword n_rows() const { return Xt.n_cols; }
+  arma::uword n_cols() const { return Xt.n_rows; }
+
+  // Writes the row i of X on out
+  void read(const arma::uword& i, arma::rowvec& out) const;
+
+private:
+  arma::sp_mat Xt;
+};
+
+// X' with its entries stored as eT. Only a dense X is stored in single
+// precision, a sparse one keeps its (double) nonzero entries.
+template <typename eT>
+arma::Mat<eT> transpose_design(const arma::mat& X) {
+  return arma::conv_to<arma::Mat<eT> >::from(X.t());
+}
+
+template <typename eT>
+arma::sp_mat transpose_design(const arma::sp_mat& X) {
+  return X.t();
+}
+
+// Calls fit with the design matrix X received by an exported function: as an
+// arma::sp_mat if X is a sparse matrix of the Matrix package, otherwise as an
+// arma::mat using the memory of X.
+template <typename Fit>
+auto with_design_matrix(SEXP X, Fit fit) {
+  if (Rf_isS4(X)) {
+    return fit(Rcpp::as<arma::sp_mat>(X));
+  }
+
+  Rcpp::NumericMatrix X_dense(X);
+
+  return fit(arma::mat(X_dense.begin(), X_dense.nrow(), X_dense.ncol(), false, true));
+}
+
+#endif
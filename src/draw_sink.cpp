@@ -0,0 +1,158 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "draw_sink.hpp"
+
+// Number of draws each chain keeps before writing them on the sink
+const int SINK_BUFFER_ROWS = 256;
+
+template <typename eT>
+DrawSink<eT>::DrawSink(eT* data, const int& n_draws, const int& n_cols, const int& n_chains, const int& n_stored) :
+  data(data), draws(n_draws), cols(n_cols), chains(n_chains), stored(n_stored),
+  unstored(static_cast<std::size_t>(n_draws) * n_chains * (n_cols - n_stored)),
+  buffer(n_chains, arma::mat(SINK_BUFFER_ROWS, n_cols)),
+  buffered(n_chains, 0), written(n_chains, 0), mapped(false), mapped_size(0) {}
+
+template <typename eT>
+DrawSink<eT>::DrawSink(const std::string& path, const int& n_draws, const int& n_cols, const int& n_chains) :
+  data(NULL), draws(n_draws), cols(n_cols), chains(n_chains), stored(n_cols),
+  buffer(n_chains, arma::mat(SINK_BUFFER_ROWS, n_cols)),
+  buffered(n_chains, 0), written(n_chains, 0), mapped(true) {
+  mapped_size = static_cast<std::size_t>(n_draws) * n_cols * n_chains * sizeof(eT);
+
+#ifdef _WIN32
+  file_handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                            CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  mapping_handle = NULL;
+
+  if (file_handle == INVALID_HANDLE_VALUE) {
+    Rcpp::stop("Could not create the draws file " + path);
+  }
+
+  if (mapped_size > 0) {
+    mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READWRITE,
+                                        static_cast<DWORD>(static_cast<unsigned long long>(mapped_size) >> 32),
+                                        static_cast<DWORD>(mapped_size & 0xFFFFFFFF), NULL);
+
+    if (mapping_handle == NULL) {
+      CloseHandle(file_handle);
+      Rcpp::stop("Could not map the draws file " + path);
+    }
+
+    data = static_cast<eT*>(MapViewOfFile(mapping_handle, FILE_MAP_ALL_ACCESS, 0, 0, mapped_size));
+
+    if (data == NULL) {
+      CloseHandle(mapping_handle);
+      CloseHandle(file_handle);
+      Rcpp::stop("Could not map the draws file " + path);
+    }
+  }
+#else
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+  if (fd == -1) {
+    Rcpp::stop("Could not create the draws file " + path);
+  }
+
+  if (mapped_size > 0) {
+    if (ftruncate(fd, mapped_size) != 0) {
+      close(fd);
+      Rcpp::stop("Could not allocate the draws file " + path);
+    }
+
+    void* addr = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED) {
+      close(fd);
+      Rcpp::stop("Could not map the draws file " + path);
+    }
+
+    data = static_cast<eT*>(addr);
+  }
+
+  close(fd); // the mapping keeps the file open
+#endif
+}
+
+template <typename eT>
+DrawSink<eT>::~DrawSink() {
+  if (!mapped) {
+    return;
+  }
+
+#ifdef _WIN32
+  if (data != NULL) {
+    FlushViewOfFile(data, 0);
+    UnmapViewOfFile(data);
+  }
+
+  if (mapping_handle != NULL) {
+    CloseHandle(mapping_handle);
+  }
+
+  CloseHandle(file_handle);
+#else
+  if (data != NULL) {
+    msync(data, mapped_size, MS_SYNC);
+    munmap(data, mapped_size);
+  }
+#endif
+}
+
+template <typename eT>
+eT* DrawSink<eT>::column(const int& chain, const int& c) {
+  if (c < stored) {
+    return data + (static_cast<std::size_t>(c) * chains + chain) * draws;
+  }
+
+  return unstored.data() + (static_cast<std::size_t>(c - stored) * chains + chain) * draws;
+}
+
+template <typename eT>
+const eT* DrawSink<eT>::column(const int& chain, const int& c) const {
+  if (c < stored) {
+    return data + (static_cast<std::size_t>(c) * chains + chain) * draws;
+  }
+
+  return unstored.data() + (static_cast<std::size_t>(c - stored) * chains + chain) * draws;
+}
+
+template <typename eT>
+void DrawSink<eT>::write(const int& chain, const arma::rowvec& row) {
+  buffer[chain].row(buffered[chain]) = row;
+  buffered[chain] ++;
+
+  if (buffered[chain] == SINK_BUFFER_ROWS) {
+    flush(chain);
+  }
+}
+
+template <typename eT>
+void DrawSink<eT>::flush(const int& chain) {
+  int n = std::min(buffered[chain], draws - written[chain]); // never writes past the end
+
+  for (int c = 0; c < cols; c++) {
+    std::copy(buffer[chain].colptr(c), buffer[chain].colptr(c) + n, column(chain, c) + written[chain]);
+  }
+
+  written[chain] += n;
+  buffered[chain] = 0;
+}
+
+template <typename eT>
+void DrawSink<eT>::read(const int& chain, const int& c, const int& n, double* out) const {
+  const eT* first = column(chain, c);
+
+  std::copy(first, first + n, out);
+}
+
+// the sinks of the sampler in double and in single precision
+template class DrawSink<double>;
+template class DrawSink<float>;
@@ -0,0 +1,70 @@
+#ifndef DRAW_SINK_HPP
+#define DRAW_SINK_HPP
+
+#include <RcppArmadillo.h>
+#include <string>
+#include <vector>
+
+// Storage for the retained draws of every chain, laid out as an
+// n_draws x n_chains x n_cols column-major array of eT (iteration x chain x
+// variable, the memory layout of a posterior::draws_array). The array is
+// either memory owned by the caller or a memory-mapped file, so long runs
+// don't need to keep all draws in RAM. Each chain buffers its rows (in double)
+// and writes them as contiguous column segments, converted to eT (double or
+// float, which halves the array). Different chains never share memory, so
+// they can write concurrently.
+template <typename eT>
+class DrawSink {
+public:
+  // Draws are written on the memory pointed by data, which only holds the
+  // first n_stored columns; the others are kept by the sink (e.g. a
+  // redundant column, dropped from the output but needed to reorder it)
+  DrawSink(eT* data, const int& n_draws, const int& n_cols, const int& n_chains, const int& n_stored);
+
+  // Draws are written on the file at path, which is created (or truncated)
+  DrawSink(const std::string& path, const int& n_draws, const int& n_cols, const int& n_chains);
+
+  ~DrawSink();
+
+  // Appends the next draw of the chain
+  void write(const int& chain, const arma::rowvec& row);
+
+  // Writes the buffered draws of the chain
+  void flush(const int& chain);
+
+  // Reads, as double, the first n draws of the column c of the chain on out.
+  // They must have been written (flushed); the chain may keep writing the
+  // next ones meanwhile.
+  void read(const int& chain, const int& c, const int& n, double* out) const;
+
+  int n_draws() const { return draws; }
+  int n_cols() const { return cols; }
+
+private:
+  eT* data;
+  int draws;
+  int cols;
+  int chains;
+  int stored;
+  std::vector<eT> unstored; // the columns from n_stored on
+  std::vector<arma::mat> buffer; // one buffer (SINK_BUFFER_ROWS x n_cols) per chain
+  std::vector<int> buffered; // number of rows in each buffer
+  std::vector<int> written; // number of rows already written for each chain
+
+  // memory-mapped file (if any)
+  bool mapped;
+  std::size_t mapped_size;
+#ifdef _WIN32
+  void* file_handle;
+  void* mapping_handle;
+#endif
+
+  // First draw of the column c of the chain
+  eT* column(const int& chain, const int& c);
+  const eT* column(const int& chain, const int& c) const;
+
+  DrawSink(const DrawSink&);
+  DrawSink& operator=(const DrawSink&);
+};
+
+#endif
@@ -5,140 +5,431 @@
 
 #include "rng_utils.hpp"
 #include "utils.hpp"
+#include "draw_sink.hpp"
+#include "convergence_monitor.hpp"
+#include "chain_state.hpp"
+#include "design_matrix.hpp"
+#include "relabeller.hpp"
+#include "normal_math.hpp"
 
-#include <unistd.h> // aqui por conta do usleep, trocar por std::this_thread::sleep_for
 #include <iostream>
 #include <cmath>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 using namespace Rcpp;
 
 // Importing the RcppParallelLibs Function from RcppParallel Package to NAMESPACE
 //' @importFrom RcppParallel RcppParallelLibs
  
-// Sample a random object from a given vector
-// Note: it just samples numeric objects (because of c++ class definition) and just one object per time.
-int numeric_sample(const arma::ivec& groups,
-                   const arma::vec& probs, std::mt19937& rng_device) {
-  double u = runif_0_1(rng_device);
+// Samples an index of {0, ..., n - 1} with probabilities proportional to the
+// non-negative weights w(0), ..., w(n - 1), whose sum is total.
+int numeric_sample(const double* w, const int& n, const double& total,
+                   Philox4x32& rng_device) {
+  double u = runif_0_1(rng_device) * total;
   double cumulativeProb = 0.0;
-  int n = probs.n_elem;
-  for (int i = 0; i < n; ++i) {
-    cumulativeProb += probs(i);
+  
+  for (int i = 0; i < n - 1; i++) {
+    cumulativeProb += w[i];
     
-    if (u <= cumulativeProb) {
-      return groups(i);
+    if (u < cumulativeProb) {
+      return i;
     }
   }
   
-  // This point should never be reached and it's here just for compiling issues
-  return 0;
+  return n - 1;
 }
 
-double S(const double& y, const double& mu, const double& sd) {
-  return R::pnorm(y, mu, sd, false, false);
+// Samples a label from the unnormalized log-probabilities lp(0), ..., lp(G - 1),
+// which are overwritten. The weights are taken relative to the largest one
+// (log-sum-exp), so they never underflow all together.
+inline int sample_label_log(double* lp, const int& G, Philox4x32& rng_device) {
+  double max_lp = lp[0];
+  double total = 0.0;
+  
+  for (int g = 1; g < G; g++) {
+    if (lp[g] > max_lp) {
+      max_lp = lp[g];
+    }
+  }
+  
+  if (!std::isfinite(max_lp)) { // degenerated case, every label is equally likely
+    return runif_index(G, rng_device);
+  }
+  
+  for (int g = 0; g < G; g++) {
+    lp[g] = std::exp(lp[g] - max_lp);
+    total += lp[g];
+  }
+  
+  return numeric_sample(lp, G, total, rng_device);
 }
 
-// Function used to sample the latent groups for each observation.
-void sample_groups(const int& G, const arma::vec& y, const arma::vec& eta, 
-                   const arma::vec& sd, arma::ivec& vec_groups,
-                   const bool& data_augmentation, const arma::mat& means,
-                   const arma::ivec& delta, std::mt19937& rng_device) {
-  arma::vec probs(G);
-  double denom;
-  int n = y.n_elem;
+// Observations are processed in blocks of fixed size, each block drawing from
+// its own random number stream derived from a per-iteration seed. Since the
+// blocks (and their streams) do not depend on the number of threads, a chain
+// gives exactly the same draws whether its blocks run sequentially or in parallel.
+const int OBS_BLOCK_SIZE = 4096;
+
+int number_of_blocks(const int& n) {
+  return (n + OBS_BLOCK_SIZE - 1) / OBS_BLOCK_SIZE;
+}
+
+// Runs the worker over the tasks [0, n_tasks), in parallel if requested
+void run_tasks(RcppParallel::Worker& worker, const int& n_tasks, const bool& parallel) {
+  if (parallel && n_tasks > 1) {
+    RcppParallel::parallelFor(0, n_tasks, worker, 1);
+  } else {
+    worker(0, n_tasks);
+  }
+}
+
+// The data are reordered once, before any kernel runs: the events first and
+// the censored observations last, each block in the user's order. The kernels
+// then process each block contiguously instead of branching on delta row by
+// row, with n_events marking where the censored block starts. Returns the
+// permutation: the i-th reordered observation is the order(i)-th of the user.
+arma::uvec partition_by_status(const arma::ivec& delta) {
+  return arma::join_cols(arma::find(delta != 0), arma::find(delta == 0));
+}
+
+// Function used to sample the latent groups for the observations first, ..., last - 1.
+// means_t is the transposed means matrix (G x n), so the means of each
+// observation are contiguous, and lp is a work buffer with G elements.
+// The means may be stored in single precision, the densities are always
+// computed in double.
+template <typename eT>
+void sample_groups(const int& G, const arma::vec& y, const arma::vec& log_eta, 
+                   const arma::vec& inv_sd, const arma::vec& log_sd,
+                   arma::ivec& vec_groups, const bool& data_augmentation,
+                   const arma::Mat<eT>& means_t, const int& n_events,
+                   Philox4x32& rng_device, double* lp, const int& first, const int& last) {
+  const eT* m;
+  double z;
+  // with data augmentation, the censored times were imputed and are used as events
+  int last_density = data_augmentation ? last : std::max(first, std::min(last, n_events));
+  
+  for (int i = first; i < last_density; i++) {
+    m = means_t.colptr(i);
+    
+    // log of eta(g) * dnorm(y(i), m(g), sd(g)), up to a constant
+    for (int g = 0; g < G; g++) {
+      z = (y(i) - m[g]) * inv_sd(g);
+      lp[g] = log_eta(g) - log_sd(g) - 0.5 * z * z;
+    }
+    
+    vec_groups(i) = sample_label_log(lp, G, rng_device);
+  }
   
-  if(data_augmentation) {
-    for (int i = 0; i < n; i++) {
-      denom = 0.0;
-      
-      for (int g = 0; g < G; g++) {
-        probs(g) = eta(g) * R::dnorm(y(i), arma::as_scalar(means(i, g)), sd(g), false);
-        denom += probs(g);
-      }
-      
-      probs = (denom == 0) * (repl(1.0 / G, G)) + (denom != 0) * (probs / denom);
-      
-      vec_groups(i) = numeric_sample(seq(0, G - 1), probs, rng_device);
+  for (int i = last_density; i < last; i++) {
+    m = means_t.colptr(i);
+    
+    // log of eta(g) * S(y(i), m(g), sd(g))
+    for (int g = 0; g < G; g++) {
+      lp[g] = (y(i) - m[g]) * inv_sd(g);
     }
-  } else {
-    for (int i = 0; i < n; i++) {
-      denom = 0.0;
-      
-      if(delta(i) == 1) {
-        for (int g = 0; g < G; g++) {
-          probs(g) = eta(g) * R::dnorm(y(i), arma::as_scalar(means(i, g)), sd(g), false);
-          denom += probs(g);
-        }
-      } else {
-        for (int g = 0; g < G; g++) {
-          probs(g) = eta(g) * S(y(i), arma::as_scalar(means(i, g)), sd(g));
-          denom += probs(g);
-        }
-      }
-      
-      probs = (denom == 0) * (repl(1.0 / G, G)) + (denom != 0) * (probs / denom);
-      
-      vec_groups(i) = numeric_sample(seq(0, G - 1), probs, rng_device);
+    
+    normal_log_upper_cdf(lp, lp, G);
+    
+    for (int g = 0; g < G; g++) {
+      lp[g] += log_eta(g);
     }
+    
+    vec_groups(i) = sample_label_log(lp, G, rng_device);
   }
 }
 
+// Samples the latent groups of each block of observations
+template <typename eT>
+struct SampleGroupsWorker : public RcppParallel::Worker {
+  const int& G;
+  const arma::vec& y;
+  const arma::vec& log_eta;
+  const arma::vec& inv_sd;
+  const arma::vec& log_sd;
+  arma::ivec& vec_groups;
+  const bool& data_augmentation;
+  const arma::Mat<eT>& means_t;
+  const int& n_events;
+  const long long int& block_seed;
+  
+  SampleGroupsWorker(const int& G, const arma::vec& y, const arma::vec& log_eta, const arma::vec& inv_sd,
+                     const arma::vec& log_sd, arma::ivec& vec_groups, const bool& data_augmentation,
+                     const arma::Mat<eT>& means_t, const int& n_events, const long long int& block_seed) :
+    G(G), y(y), log_eta(log_eta), inv_sd(inv_sd), log_sd(log_sd), vec_groups(vec_groups), data_augmentation(data_augmentation), means_t(means_t), n_events(n_events), block_seed(block_seed) {}
+  
+  void operator()(std::size_t begin, std::size_t end) {
+    Philox4x32 rng_device;
+    arma::vec lp(G);
+    int n = y.n_elem;
+    int first, last;
+    
+    for (std::size_t b = begin; b < end; b++) {
+      setSeed(block_seed, b, rng_device);
+      first = b * OBS_BLOCK_SIZE;
+      last = std::min(first + OBS_BLOCK_SIZE, n);
+      sample_groups(G, y, log_eta, inv_sd, log_sd, vec_groups, data_augmentation, means_t, n_events, rng_device, lp.memptr(), first, last);
+    }
+  }
+};
+
 // Function used to sample random groups for each observation proportional to the eta parameter
 arma::ivec sample_groups_start(const int& G, const arma::vec& y, const arma::vec& eta,
-                               std::mt19937& rng_device) {
+                               Philox4x32& rng_device) {
   int n = y.n_elem;
   arma::ivec vec_groups(n);
   
   for (int i = 0; i < n; i++) {
-    vec_groups(i) = numeric_sample(seq(0, G - 1), eta, rng_device);
+    vec_groups(i) = numeric_sample(eta.memptr(), G, arma::sum(eta), rng_device);
   }
   
   return(vec_groups);
 }
 
-// Function used to simulate survival time for censored observations.
-arma::vec augment(const int& G, const arma::vec& y, const arma::ivec& groups,
-                  const arma::ivec& delta, const arma::vec& sd,
-                  std::mt19937& rng_device, const arma::mat& means) {
-  arma::vec out = y;
-  arma::uvec censored_indexes = arma::find(delta == 0); // finding which observations are censored
+// Per-group sufficient statistics used by the data augmentation Gibbs sampler.
+// For each group g, XtX.slice(g) holds X_g' X_g (only the upper triangle is
+// kept up to date), Xty.col(g) holds X_g' y_g and yty(g) holds y_g' y_g, where
+// y is the augmented response. They are updated incrementally, so the full
+// conditionals of beta and phi never need to gather the rows of each group.
+struct GroupStats {
+  arma::cube XtX;
+  arma::mat Xty;
+  arma::vec yty;
+};
+
+// Adds (sign = 1.0) or removes (sign = -1.0) the observation (x, y) from the
+// statistics of group g. The covariates may be stored in single precision,
+// the statistics are always accumulated in double.
+template <typename eT>
+void add_observation(GroupStats& stats, const eT* x, const double& y,
+                     const int& p, const int& g, const double& sign) {
+  double* XtX_g = stats.XtX.slice_memptr(g);
+  double* Xty_g = stats.Xty.colptr(g);
+  double xc;
+  
+  for (int c = 0; c < p; c++) {
+    xc = sign * x[c];
+    
+    for (int r = 0; r <= c; r++) {
+      XtX_g[c * p + r] += xc * x[r];
+    }
+    
+    Xty_g[c] += xc * y;
+  }
   
-  double out_i;
-  int count;
-  double mean;
+  stats.yty(g) += sign * y * y;
+}
+
+// Accumulates on (Xty_g, yty_g) the change of the response of the observation
+// x from y_old to y_new
+template <typename eT>
+void shift_response(double* Xty_g, double& yty_g, const eT* x, const double& y_old,
+                    const double& y_new, const int& p) {
+  double diff = y_new - y_old;
+  
+  for (int c = 0; c < p; c++) {
+    Xty_g[c] += diff * x[c];
+  }
   
-  for (int i : censored_indexes) {
-    out_i = y(i);
-    count = 0;
-    mean = arma::as_scalar(means(i, groups(i)));
+  yty_g += y_new * y_new - y_old * y_old;
+}
+
+// add_observation and shift_response for the observation i, whose covariates
+// are the column i of Xt. The columns of a sparse Xt only touch the entries
+// of their nonzero covariates.
+template <typename eT>
+void add_observation(GroupStats& stats, const arma::Mat<eT>& Xt, const arma::uword& i,
+                     const double& y, const int& g, const double& sign) {
+  add_observation(stats, Xt.colptr(i), y, Xt.n_rows, g, sign);
+}
+
+void add_observation(GroupStats& stats, const arma::sp_mat& Xt, const arma::uword& i,
+                     const double& y, const int& g, const double& sign) {
+  int p = Xt.n_rows;
+  double* XtX_g = stats.XtX.slice_memptr(g);
+  double* Xty_g = stats.Xty.colptr(g);
+  arma::uword first = Xt.col_ptrs[i];
+  arma::uword last = Xt.col_ptrs[i + 1];
+  arma::uword c;
+  double xc;
+  
+  // the row indices of a column are increasing, so r <= c below
+  for (arma::uword a = first; a < last; a++) {
+    c = Xt.row_indices[a];
+    xc = sign * Xt.values[a];
     
-    // sample out(i) value
-    while(out_i <= y(i)) {
-      out_i = rnorm_(mean, sd(groups(i)), rng_device);
-      
-      // break if it seems like it's going to run forever
-      if(count >= 10000) {
-        out_i = 1.01 * y(i); // increment y(i) by 1%
-        break;
+    for (arma::uword b = first; b <= a; b++) {
+      XtX_g[c * p + Xt.row_indices[b]] += xc * Xt.values[b];
+    }
+    
+    Xty_g[c] += xc * y;
+  }
+  
+  stats.yty(g) += sign * y * y;
+}
+
+template <typename eT>
+void shift_response(double* Xty_g, double& yty_g, const arma::Mat<eT>& Xt, const arma::uword& i,
+                    const double& y_old, const double& y_new) {
+  shift_response(Xty_g, yty_g, Xt.colptr(i), y_old, y_new, Xt.n_rows);
+}
+
+void shift_response(double* Xty_g, double& yty_g, const arma::sp_mat& Xt, const arma::uword& i,
+                    const double& y_old, const double& y_new) {
+  double diff = y_new - y_old;
+  
+  for (arma::uword a = Xt.col_ptrs[i]; a < Xt.col_ptrs[i + 1]; a++) {
+    Xty_g[Xt.row_indices[a]] += diff * Xt.values[a];
+  }
+  
+  yty_g += y_new * y_new - y_old * y_old;
+}
+
+// Observations to add to (weight 1) or remove from (weight -1) the statistics
+// of each group, in increasing order of the observations
+typedef std::vector<std::vector<std::pair<int, double> > > GroupMoves;
+
+// Updates the statistics of each group g in [begin, end) with its moves. When
+// rebuild is true, the statistics are zeroed first. Each group only touches
+// its own statistics, so the groups can be processed in parallel.
+template <typename MatType>
+struct GroupStatsWorker : public RcppParallel::Worker {
+  GroupStats& stats;
+  const MatType& Xt;
+  const arma::vec& y_aug;
+  const GroupMoves& moves;
+  const bool rebuild;
+  
+  GroupStatsWorker(GroupStats& stats, const MatType& Xt, const arma::vec& y_aug,
+                   const GroupMoves& moves, const bool rebuild) :
+    stats(stats), Xt(Xt), y_aug(y_aug), moves(moves), rebuild(rebuild) {}
+  
+  void operator()(std::size_t begin, std::size_t end) {
+    for (std::size_t g = begin; g < end; g++) {
+      if (rebuild) {
+        stats.XtX.slice(g).zeros();
+        stats.Xty.col(g).zeros();
+        stats.yty(g) = 0.0;
       }
       
-      count ++;
+      for (const std::pair<int, double>& move : moves[g]) {
+        add_observation(stats, Xt, move.first, y_aug(move.first), g, move.second);
+      }
     }
-    
-    out(i) = out_i;
+  }
+};
+
+// Computes the statistics from scratch. Used at the start of the chain and,
+// periodically, to discard the rounding error accumulated by the updates.
+template <typename MatType>
+void build_group_stats(GroupStats& stats, const MatType& Xt, const arma::vec& y_aug,
+                       const arma::ivec& groups, const int& G, const bool& parallel) {
+  int n = Xt.n_cols;
+  GroupMoves moves(G);
+  
+  stats.XtX.set_size(Xt.n_rows, Xt.n_rows, G);
+  stats.Xty.set_size(Xt.n_rows, G);
+  stats.yty.set_size(G);
+  
+  for (int i = 0; i < n; i++) {
+    moves[groups(i)].push_back(std::make_pair(i, 1.0));
   }
   
-  return out;
+  GroupStatsWorker worker(stats, Xt, y_aug, moves, true);
+  run_tasks(worker, G, parallel);
 }
 
+// Moves every observation whose label changed from groups_prev to groups. The
+// changed observations are found in a single pass, so each group only walks
+// its own moves.
+template <typename MatType>
+void update_group_stats(GroupStats& stats, const MatType& Xt, const arma::vec& y_aug,
+                        const arma::ivec& groups_prev, const arma::ivec& groups,
+                        const int& G, const bool& parallel) {
+  int n = Xt.n_cols;
+  GroupMoves moves(G);
+  
+  for (int i = 0; i < n; i++) {
+    if (groups(i) != groups_prev(i)) {
+      moves[groups_prev(i)].push_back(std::make_pair(i, -1.0));
+      moves[groups(i)].push_back(std::make_pair(i, 1.0));
+    }
+  }
+  
+  GroupStatsWorker worker(stats, Xt, y_aug, moves, false);
+  run_tasks(worker, G, parallel);
+}
+
+// Function used to simulate survival time for the censored observations
+// censored_indexes(first), ..., censored_indexes(last - 1). The new values are
+// written directly on y_aug and their effect on the statistics of each group
+// is accumulated on (dXty, dyty). means_t has the precision of Xt.
+template <typename MatType>
+void augment(const arma::vec& y, arma::vec& y_aug, const arma::ivec& groups,
+             const arma::uvec& censored_indexes, const arma::vec& sd,
+             Philox4x32& rng_device, const arma::Mat<typename MatType::elem_type>& means_t,
+             const MatType& Xt, arma::mat& dXty, arma::vec& dyty,
+             const int& first, const int& last) {
+  int i;
+  double out_i;
+  
+  for (int k = first; k < last; k++) {
+    i = censored_indexes(k);
+    
+    // sample out(i) value from the normal truncated at the censoring time
+    out_i = rtruncnorm_lower_(means_t(groups(i), i), sd(groups(i)), y(i), rng_device);
+    
+    shift_response(dXty.colptr(groups(i)), dyty(groups(i)), Xt, i, y_aug(i), out_i);
+    y_aug(i) = out_i;
+  }
+}
+
+// Augments each block of censored observations, keeping the changes on the
+// statistics of the groups separated by block (dXty.slice(b), dyty.col(b))
+template <typename MatType>
+struct AugmentWorker : public RcppParallel::Worker {
+  const arma::vec& y;
+  arma::vec& y_aug;
+  const arma::ivec& groups;
+  const arma::uvec& censored_indexes;
+  const arma::vec& sd;
+  const arma::Mat<typename MatType::elem_type>& means_t;
+  const MatType& Xt;
+  arma::cube& dXty;
+  arma::mat& dyty;
+  const long long int& block_seed;
+  
+  AugmentWorker(const arma::vec& y, arma::vec& y_aug, const arma::ivec& groups, const arma::uvec& censored_indexes,
+                const arma::vec& sd, const arma::Mat<typename MatType::elem_type>& means_t, const MatType& Xt, arma::cube& dXty, arma::mat& dyty,
+                const long long int& block_seed) :
+    y(y), y_aug(y_aug), groups(groups), censored_indexes(censored_indexes), sd(sd), means_t(means_t), Xt(Xt), dXty(dXty), dyty(dyty), block_seed(block_seed) {}
+  
+  void operator()(std::size_t begin, std::size_t end) {
+    Philox4x32 rng_device;
+    arma::vec dyty_b(dyty.n_rows);
+    int n = censored_indexes.n_elem;
+    int first, last;
+    
+    for (std::size_t b = begin; b < end; b++) {
+      setSeed(block_seed, b, rng_device);
+      first = b * OBS_BLOCK_SIZE;
+      last = std::min(first + OBS_BLOCK_SIZE, n);
+      dXty.slice(b).zeros();
+      dyty_b.zeros();
+      augment(y, y_aug, groups, censored_indexes, sd, rng_device, means_t, Xt, dXty.slice(b), dyty_b, first, last);
+      dyty.col(b) = dyty_b;
+    }
+  }
+};
+
 // Create a table for each numeric element in the vector groups.
 arma::ivec groups_table(const int& G, const arma::ivec& groups) {
-  arma::ivec out(G);
-  arma::ivec index;
+  arma::ivec out(G, arma::fill::zeros);
+  int n = groups.n_elem;
   
-  for (int g = 0; g < G; g++) {
-    index = groups(arma::find(groups == g));
-    out(g) = index.n_rows;
+  for (int i = 0; i < n; i++) {
+    out(groups(i)) ++;
   }
   
   return out;
@@ -146,48 +437,57 @@ arma::ivec groups_table(const int& G, const arma::ivec& groups) {
 
 /* Auxiliary functions for EM algorithm */
 
-// Compute weights matrix
-arma::mat compute_W(const arma::vec& y, const arma::mat& X, const arma::vec& eta, 
-                    const arma::mat& beta, const arma::vec& sigma, 
-                    const int& G, const int& n, double& denom, arma::mat& mat_denom, const arma::rowvec& repl_vec) {
-  arma::mat out(n, G);
+// E-step of the EM: fills the preallocated n x G matrix W with the weights of
+// the groups for each observation, from the means matrix (n x G) already
+// computed by the caller. The weights are computed in log-space and
+// normalized with the log-sum-exp, so outlying observations don't underflow.
+// If censored, the censored observations (the rows from n_events on) are
+// weighted by the survival function instead of the density. Returns the
+// log-likelihood sum_i log(sum_g eta_g f_g(y_i)).
+double e_step_em(const arma::vec& y, const arma::mat& mean, const arma::vec& eta, const arma::vec& sd,
+                 const int& n_events, const bool& censored, arma::mat& W) {
+  int G = eta.n_elem;
+  int n = y.n_elem;
+  int last_density = censored ? n_events : n;
   
-  for(int g = 0; g < G; g++) {
-    mat_denom.col(g) = eta(g) * arma::normpdf(y,
-                  X * beta.row(g).t(),
-                  repl(sigma(g), n));
+  for (int g = 0; g < G; g++) {
+    if (last_density > 0) {
+      W.col(g).head(last_density) = std::log(eta(g)) - std::log(sd(g)) - 0.5 * std::log(2.0 * M_PI) -
+        0.5 * arma::square((y.head(last_density) - mean.col(g).head(last_density)) / sd(g));
+    }
+    
+    if (last_density < n) {
+      arma::vec z = (y.tail(n - last_density) - mean.col(g).tail(n - last_density)) / sd(g);
+      
+      normal_log_upper_cdf(z.memptr(), W.colptr(g) + last_density, n - last_density);
+      W.col(g).tail(n - last_density) += std::log(eta(g));
+    }
   }
   
-  for(int i = 0; i < n; i++) {
-    denom = arma::sum(mat_denom.row(i));
-    if(denom > 0) {
-      out.row(i) = mat_denom.row(i) / denom;
-    } else {
-      out.row(i) = repl_vec;
-    }
+  arma::vec max_lp = arma::max(W, 1);
+  W.each_col() -= max_lp;
+  W = arma::exp(W);
+  
+  arma::vec total = arma::sum(W, 1);
+  W.each_col() /= total;
+  
+  // degenerated rows (e.g. with every weight zero), every group is equally likely
+  for (arma::uword i : arma::find_nonfinite(max_lp)) {
+    W.row(i).fill(1.0 / G);
   }
   
-  return out;
+  return arma::accu(max_lp + arma::log(total));
 }
 
 // Function used to computed the expected value of a truncated normal distribution
 double compute_expected_value_truncnorm(const double& alpha, const double& mean, const double& sigma) {
-  double out;
-  
-  if (R::pnorm(alpha, 0.0, 1.0, true, false) < 1.0) {
-    out = mean + sigma *
-      (R::dnorm(alpha, 0.0, 1.0, false)/(R::pnorm(alpha, 0.0, 1.0, false, false)));
-  } else {
-    out = mean + sigma *
-      (R::dnorm(alpha, 0.0, 1.0, false)/0.0001);
-  }
-  
-  return out;
+  return mean + sigma * normal_inverse_mills_ratio(alpha);
 }
 
 // Create the latent variable z for censored observations
+template <typename MatType>
 arma::vec augment_em(const arma::vec& y, const arma::uvec& censored_indexes,
-                     const arma::mat& X, const arma::mat& beta,
+                     const MatType& X, const arma::mat& beta,
                      const arma::vec& sigma, const arma::mat& W,
                      const int& G, const arma::mat& mean,
                      const int& n) {
@@ -221,7 +521,7 @@ arma::ivec sample_groups_from_W(const arma::mat& W, const int& n) {
 }
 
 // Sample initial values for the EM parameters
-void sample_initial_values_em(arma::vec& eta, arma::vec& phi, arma::mat& beta, arma::vec& sd, const int& G, const int& k, std::mt19937& rng_device) {
+void sample_initial_values_em(arma::vec& eta, arma::vec& phi, arma::mat& beta, arma::vec& sd, const int& G, const int& k, Philox4x32& rng_device) {
   eta = rdirichlet(repl(rgamma_(1.0, 1.0, rng_device), G), rng_device);
   
   for (int g = 0; g < G; g++) {
@@ -235,34 +535,126 @@ void sample_initial_values_em(arma::vec& eta, arma::vec& phi, arma::mat& beta, a
   sd = 1.0 / sqrt(phi);
 }
 
-// Update the matrix beta for the group g
-void update_beta_g(const arma::vec& colg, const arma::mat& X, const int& g, const arma::vec& z, arma::mat& beta,
-                   arma::sp_mat& Wg) {
-  Wg = arma::diagmat(colg);
-  arma::mat S = X.t() * Wg * X; 
+// Number of rows of X in each block of weighted_gram, small enough for the
+// block and its scaled copy to stay in cache while every group uses them
+const int WLS_BLOCK_SIZE = 512;
+
+// Weighted Gram matrices of all the groups in a single pass over the rows of X:
+// XtWX.slice(g) = X' diag(W.col(g)) X and XtWz.col(g) = X' diag(W.col(g)) z.
+// Each block of rows is scaled by the square roots of the weights, so its
+// contribution Xs' Xs is a symmetric rank-k update (BLAS syrk).
+void weighted_gram(const arma::mat& X, const arma::mat& W, const arma::vec& z,
+                   arma::cube& XtWX, arma::mat& XtWz) {
+  int n = X.n_rows;
+  int k = X.n_cols;
+  int G = W.n_cols;
+  arma::mat X_block;
+  arma::mat Xs;
+  arma::vec sqrt_w;
   
-  if(arma::det(makeSymmetric(S)) < 1e-10) { // regularization if matrix is poorly conditioned
-    S += 1e-8 * arma::eye(S.n_cols, S.n_cols);
+  XtWX.zeros(k, k, G);
+  XtWz.zeros(k, G);
+  
+  for (int first = 0; first < n; first += WLS_BLOCK_SIZE) {
+    int last = std::min(first + WLS_BLOCK_SIZE, n) - 1;
+    X_block = X.rows(first, last);
+    
+    for (int g = 0; g < G; g++) {
+      sqrt_w = arma::sqrt(W.col(g).subvec(first, last));
+      Xs = X_block.each_col() % sqrt_w;
+      
+      XtWX.slice(g) += Xs.t() * Xs;
+      XtWz.col(g) += Xs.t() * (sqrt_w % z.subvec(first, last));
+    }
+  }
+}
+
+// weighted_gram for a sparse X. The rows are read as the columns of X', and
+// each one only adds the products of its nonzero covariates.
+void weighted_gram(const arma::sp_mat& X, const arma::mat& W, const arma::vec& z,
+                   arma::cube& XtWX, arma::mat& XtWz) {
+  int n = X.n_rows;
+  int k = X.n_cols;
+  int G = W.n_cols;
+  arma::sp_mat Xt = X.t();
+  double* XtWX_g;
+  arma::uword c;
+  double wx;
+  
+  XtWX.zeros(k, k, G);
+  XtWz.zeros(k, G);
+  
+  for (int i = 0; i < n; i++) {
+    arma::uword first = Xt.col_ptrs[i];
+    arma::uword last = Xt.col_ptrs[i + 1];
+    
+    for (int g = 0; g < G; g++) {
+      XtWX_g = XtWX.slice_memptr(g);
+      
+      for (arma::uword a = first; a < last; a++) {
+        c = Xt.row_indices[a];
+        wx = W(i, g) * Xt.values[a];
+        
+        for (arma::uword b = first; b <= a; b++) {
+          XtWX_g[c * k + Xt.row_indices[b]] += wx * Xt.values[b];
+        }
+        
+        XtWz(c, g) += wx * z(i);
+      }
+    }
+  }
+  
+  for (int g = 0; g < G; g++) {
+    XtWX.slice(g) = arma::symmatu(XtWX.slice(g));
+  }
+}
+
+// Lower Cholesky factor L of A, if A is numerically of full rank (the same
+// check on the diagonal of L of rmvnorm_precision)
+bool chol_full_rank(arma::mat& L, const arma::mat& A) {
+  if (!arma::chol(L, A, "lower")) {
+    return false;
+  }
+  
+  arma::vec L_diag = L.diag();
+  
+  return L_diag.is_finite() && L_diag.min() > 1e-8 * L_diag.max();
+}
+
+// Solves the (weighted) normal equations S b = r by Cholesky. If S is rank
+// deficient, a small ridge is added to its diagonal. Returns false, without
+// changing b, if it still can't be solved.
+bool solve_wls(const arma::mat& S, const arma::vec& r, arma::vec& b) {
+  arma::mat L;
+  
+  if (!chol_full_rank(L, S)) {
+    arma::mat S_ridge = S;
+    S_ridge.diag() += 1e-8 * std::max(1.0, arma::trace(S) / S.n_cols);
+    
+    if (!chol_full_rank(L, S_ridge)) {
+      return false;
+    }
   }
   
-  beta.row(g) = arma::solve(makeSymmetric(S), X.t() * Wg * z, arma::solve_opts::likely_sympd).t();
+  b = arma::solve(arma::trimatu(L.t()), arma::solve(arma::trimatl(L), r));
+  return true;
 }
 
 // Update the parameter phi(g)
-void update_phi_g(const double& denom, const arma::uvec& censored_indexes, const arma::mat& X, const arma::vec& colg, const arma::vec& y, const arma::vec& z,
-                  const arma::vec& sd, const arma::mat& beta, const arma::vec& var, const int& g, const int& n, arma::vec& phi, std::mt19937& rng_device,
+template <typename MatType>
+void update_phi_g(const double& denom, const arma::uvec& censored_indexes, const MatType& X, const arma::vec& colg, const arma::vec& y, const arma::vec& z,
+                  const arma::vec& sd, const arma::mat& beta, const arma::vec& var, const int& g, const int& n, arma::vec& phi, Philox4x32& rng_device,
                   double& alpha, double& quant) {
+  arma::vec mean_g = X * beta.row(g).t();
+  
   alpha = 0.0;
-  quant = arma::as_scalar(arma::square(z - (X * beta.row(g).t())).t() * colg);
+  quant = arma::as_scalar(arma::square(z - mean_g).t() * colg);
   
   for(int i : censored_indexes) {
-    alpha = (y(i) - arma::as_scalar(X.row(i) * beta.row(g).t())) / sd(g);
+    alpha = (y(i) - mean_g(i)) / sd(g);
+    double mills = normal_inverse_mills_ratio(alpha);
     
-    if(R::pnorm(alpha, 0.0, 1.0, true, false) < 1.0) {
-      quant += colg(i) * var(g) * (1.0 + alpha * R::dnorm(alpha, 0.0, 1.0, false)/(R::pnorm(alpha, 0.0, 1.0, false, false)) - square(R::dnorm(alpha, 0.0, 1.0, false)/(R::pnorm(alpha, 0.0, 1.0, false, false))));
-    } else {
-      quant += colg(i) * var(g) * (1.0 + alpha * R::dnorm(alpha, 0.0, 1.0, false)/0.0001 - square(R::dnorm(alpha, 0.0, 1.0, false)/0.0001));
-    }
+    quant += colg(i) * var(g) * (1.0 + alpha * mills - square(mills));
   }
   
   // to avoid numerical problems
@@ -278,11 +670,16 @@ void update_phi_g(const double& denom, const arma::uvec& censored_indexes, const
   }
 }
 
-// Update the model parameters with EM
-void update_em_parameters(const int& n, const int& G, arma::vec& eta, arma::mat& beta, arma::vec& phi, const arma::mat& W, const arma::mat& X, 
-                          const arma::vec& y, const arma::vec& z, const arma::uvec& censored_indexes, const arma::vec& sd, std::mt19937& rng_device,
-                          double& quant, double& denom, double& alpha, arma::sp_mat& Wg, arma::vec& colg) {
+// Update the model parameters with EM. XtWX and XtWz are buffers for the
+// weighted Gram matrices of the groups.
+template <typename MatType>
+void update_em_parameters(const int& n, const int& G, arma::vec& eta, arma::mat& beta, arma::vec& phi, const arma::mat& W, const MatType& X, 
+                          const arma::vec& y, const arma::vec& z, const arma::uvec& censored_indexes, const arma::vec& sd, Philox4x32& rng_device,
+                          double& quant, double& denom, double& alpha, arma::cube& XtWX, arma::mat& XtWz, arma::vec& colg) {
   arma::vec var = arma::square(sd);
+  arma::vec beta_g;
+  
+  weighted_gram(X, W, z, XtWX, XtWz);
   
   for (int g = 0; g < G; g++) {
     colg = W.col(g);
@@ -293,42 +690,245 @@ void update_em_parameters(const int& n, const int& G, arma::vec& eta, arma::mat&
       eta = rdirichlet(repl(1.0, G), rng_device);
     }
     
-    update_beta_g(colg, X, g, z, beta, Wg); // updating beta for the group g
+    // updating beta for the group g
+    if (solve_wls(XtWX.slice(g), XtWz.col(g), beta_g)) {
+      beta.row(g) = beta_g.t();
+    }
+    
     update_phi_g(arma::sum(colg), censored_indexes, X, colg, y, z, sd, beta, var, g, n, phi, rng_device, alpha, quant);
   }
 }
 
-// Compute model's log-likelihood to select the EM initial values
-double loglik_em(const arma::vec& eta, const arma::vec& sd, const arma::mat& W, const arma::vec& z, const int& G, const int& N, const arma::mat& mean, const arma::uvec& censored_indexes) {
-  double loglik = 0.0;
+// One EM update of eta, beta and phi. W holds the weights of the previous
+// update, used to augment the censored observations, and is replaced by the new ones.
+template <typename MatType>
+void em_iteration(const int& n, const int& G, const arma::vec& y, const int& n_events, const MatType& X,
+                  const arma::uvec& censored_indexes, arma::vec& eta, arma::mat& beta, arma::vec& phi, arma::mat& W,
+                  arma::vec& sd, arma::vec& z, arma::mat& mean, Philox4x32& rng_device,
+                  double& quant, double& denom, double& alpha, arma::cube& XtWX, arma::mat& XtWz, arma::vec& colg) {
+  mean = X * beta.t();
+  sd = 1.0 / sqrt(phi);
+  z = augment_em(y, censored_indexes, X, beta, sd, W, G, mean, n);
+  e_step_em(z, mean, eta, sd, n_events, false, W);
+  update_em_parameters(n, G, eta, beta, phi, W, X, y, z, censored_indexes, sd, rng_device, quant, denom, alpha, XtWX, XtWz, colg);
+}
+
+// eta, beta and phi as an unconstrained vector (log(eta), beta by columns and
+// log(phi)), where the SQUAREM extrapolation can't leave the parameter space
+arma::vec em_params_to_vec(const arma::vec& eta, const arma::mat& beta, const arma::vec& phi) {
+  return arma::join_cols(arma::log(eta), arma::vectorise(beta), arma::log(phi));
+}
+
+// Inverse of em_params_to_vec, normalizing eta
+void em_params_from_vec(const arma::vec& theta, const int& G, const int& k,
+                        arma::vec& eta, arma::mat& beta, arma::vec& phi) {
+  arma::vec log_eta = theta.head(G);
+  
+  eta = arma::exp(log_eta - log_eta.max());
+  eta /= arma::sum(eta);
+  beta = arma::reshape(theta.subvec(G, G + G * k - 1), G, k);
+  phi = arma::exp(theta.tail(G));
+}
+
+// Observed log-likelihood of eta, beta and phi, where the censored observations
+// enter by their survival function. mean and W_loglik are overwritten.
+template <typename MatType>
+double em_loglik(const arma::vec& y, const int& n_events, const MatType& X, const arma::vec& eta,
+                 const arma::mat& beta, const arma::vec& phi, arma::mat& mean, arma::mat& W_loglik) {
+  mean = X * beta.t();
+  return e_step_em(y, mean, eta, 1.0 / sqrt(phi), n_events, true, W_loglik);
+}
+
+// Maximum number of times a SQUAREM step is moved halfway to -1 before the
+// cycle falls back to the plain EM update
+const int SQUAREM_MAX_BACKTRACKS = 5;
+
+// One SQUAREM cycle (Varadhan and Roland, 2008, scheme S3). Two EM updates from
+// theta_0 give r = theta_1 - theta_0 and v = (theta_2 - theta_1) - r, then the
+// parameters jump to theta_0 - 2 a r + a^2 v, with a = -||r|| / ||v|| (at most
+// -1, which is just theta_2), and a third EM update stabilizes them. The jump
+// is kept only if the observed log-likelihood did not drop below the one at
+// theta_0 (loglik, NaN if unknown, updated here); otherwise a is moved halfway
+// to -1 and the jump retried, and if that keeps failing or the extrapolation
+// breaks down, the cycle ends at theta_2. Returns the number of EM updates done.
+template <typename MatType>
+int squarem_iteration(const int& n, const int& G, const arma::vec& y, const int& n_events, const MatType& X,
+                      const arma::uvec& censored_indexes, arma::vec& eta, arma::mat& beta, arma::vec& phi, arma::mat& W,
+                      arma::vec& sd, arma::vec& z, arma::mat& mean, Philox4x32& rng_device,
+                      double& quant, double& denom, double& alpha, arma::cube& XtWX, arma::mat& XtWz, arma::vec& colg,
+                      double& loglik, arma::mat& W_loglik) {
+  int k = X.n_cols;
+  int em_updates = 2;
+  arma::vec theta_0 = em_params_to_vec(eta, beta, phi);
   
-  for(int i = 0; i < N; i++) {
-    if(arma::any(censored_indexes == i)) {
-      for (int g = 0; g < G; g++) {
-        if (eta(g) * R::pnorm((z(i) - mean(i, g))/sd(g), 0.0, 1.0, false, false) == 0.0) {
-          loglik += W(i, g) * log(0.00001);
-        } else {
-          loglik += W(i, g) * log(eta(g) * R::pnorm((z(i) - mean(i, g))/sd(g), 0.0, 1.0, false, false));
+  if (!std::isfinite(loglik)) {
+    loglik = em_loglik(y, n_events, X, eta, beta, phi, mean, W_loglik);
+  }
+  
+  double loglik_0 = loglik;
+  
+  em_iteration(n, G, y, n_events, X, censored_indexes, eta, beta, phi, W, sd, z, mean, rng_device, quant, denom, alpha, XtWX, XtWz, colg);
+  arma::vec theta_1 = em_params_to_vec(eta, beta, phi);
+  
+  em_iteration(n, G, y, n_events, X, censored_indexes, eta, beta, phi, W, sd, z, mean, rng_device, quant, denom, alpha, XtWX, XtWz, colg);
+  arma::vec theta_2 = em_params_to_vec(eta, beta, phi);
+  
+  arma::vec r = theta_1 - theta_0;
+  arma::vec v = theta_2 - theta_1 - r;
+  double norm_v = arma::norm(v);
+  
+  // the log-likelihood at theta_2 isn't computed, the next cycle does it if needed
+  loglik = arma::datum::nan;
+  
+  if (!theta_2.is_finite() || norm_v == 0.0) {
+    return em_updates;
+  }
+  
+  arma::vec eta_2 = eta, phi_2 = phi;
+  arma::mat beta_2 = beta, W_2 = W;
+  double step = std::min(-arma::norm(r) / norm_v, -1.0);
+  
+  for (int backtrack = 0; step < -1.0 && backtrack <= SQUAREM_MAX_BACKTRACKS; backtrack++) {
+    arma::vec theta = theta_0 - 2.0 * step * r + step * step * v;
+    
+    if (theta.is_finite()) {
+      em_params_from_vec(theta, G, k, eta, beta, phi);
+      mean = X * beta.t();
+      e_step_em(y, mean, eta, 1.0 / sqrt(phi), n_events, false, W);
+      em_iteration(n, G, y, n_events, X, censored_indexes, eta, beta, phi, W, sd, z, mean, rng_device, quant, denom, alpha, XtWX, XtWz, colg);
+      em_updates++;
+      
+      if (eta.is_finite() && beta.is_finite() && phi.is_finite()) {
+        double loglik_new = em_loglik(y, n_events, X, eta, beta, phi, mean, W_loglik);
+        
+        if (loglik_new >= loglik_0) {
+          loglik = loglik_new;
+          return em_updates;
         }
       }
-    } else {
-      for(int g = 0; g < G; g++) {
-        if (eta(g) * R::dnorm(z(i), arma::as_scalar(mean(i, g)), sd(g), false) == 0.0) {
-          loglik += W(i, g) * log(0.00001);
-        } else {
-          loglik += W(i, g) * log(eta(g) * R::dnorm(z(i), arma::as_scalar(mean(i, g)), sd(g), false));
-        }
+    }
+    
+    step = (step - 1.0) / 2.0;
+  }
+  
+  eta = eta_2;
+  beta = beta_2;
+  phi = phi_2;
+  W = W_2;
+  
+  return em_updates;
+}
+
+template <typename MatType>
+arma::field<arma::mat> lognormal_mixture_em(const int& Niter, const int& G, const arma::vec& t, const arma::ivec& delta, const MatType& X,
+                                            const bool& better_initial_values, const int& N_em,
+                                            const int& Niter_em, const bool& internal, const bool& show_output, Philox4x32& rng_device,
+                                            const arma::field<arma::mat>& start_params, const double& tol, const bool& squarem);
+
+// Reads eta, beta and phi from a row of the EM iterations matrix, where each
+// group g has the columns eta_g, beta_g and phi_g
+void params_from_em_row(const arma::rowvec& row, const int& G, const int& k,
+                        arma::vec& eta, arma::mat& beta, arma::vec& phi) {
+  for (int g = 0; g < G; g++) {
+    int col = g * (k + 2);
+    
+    eta(g) = row(col);
+    beta.row(g) = row.cols(col + 1, col + k);
+    phi(g) = row(col + k + 1);
+  }
+}
+
+// Runs the short EM's of the initial values search, each one on its own
+// random number stream, keeping only their final parameters and log-likelihood
+template <typename MatType>
+struct EMSearchWorker : public RcppParallel::Worker {
+  const int& G;
+  const arma::vec& t;
+  const arma::ivec& delta;
+  const MatType& X;
+  const int& Niter_em;
+  const long long int& search_seed;
+  arma::mat& search_eta; // G x N_em
+  arma::cube& search_beta; // G x k x N_em
+  arma::mat& search_phi; // G x N_em
+  arma::vec& search_loglik;
+  
+  EMSearchWorker(const int& G, const arma::vec& t, const arma::ivec& delta, const MatType& X,
+                 const int& Niter_em, const long long int& search_seed, arma::mat& search_eta,
+                 arma::cube& search_beta, arma::mat& search_phi, arma::vec& search_loglik) :
+    G(G), t(t), delta(delta), X(X), Niter_em(Niter_em), search_seed(search_seed), search_eta(search_eta),
+    search_beta(search_beta), search_phi(search_phi), search_loglik(search_loglik) {}
+  
+  void operator()(std::size_t begin, std::size_t end) {
+    Philox4x32 rng_device;
+    int k = X.n_cols;
+    arma::vec eta(G), phi(G);
+    arma::mat beta(G, k);
+    
+    for (std::size_t init = begin; init < end; init++) {
+      setSeed(search_seed, init, rng_device);
+      
+      arma::field<arma::mat> em_params = lognormal_mixture_em(Niter_em, G, t, delta, X, false, 0, 0, false, false, rng_device, arma::field<arma::mat>(), 0.0, false);
+      
+      params_from_em_row(em_params(0).row(Niter_em - 1), G, k, eta, beta, phi);
+      search_eta.col(init) = eta;
+      search_beta.slice(init) = beta;
+      search_phi.col(init) = phi;
+      search_loglik(init) = arma::as_scalar(em_params(1));
+    }
+  }
+};
+
+// Searches for the EM initial values among N_em short EM's of Niter_em
+// iterations, run in parallel, and sets eta, beta and phi to the ones with
+// maximum log-likelihood. Each EM has its own random number stream, so the
+// result doesn't depend on the number of threads; ties go to the first one.
+template <typename MatType>
+void search_initial_values_em(const int& G, const arma::vec& t, const arma::ivec& delta, const MatType& X,
+                              const int& N_em, const int& Niter_em, const bool& show_output, Philox4x32& rng_device,
+                              arma::vec& eta, arma::mat& beta, arma::vec& phi) {
+  int k = X.n_cols;
+  long long int search_seed = rseed_(rng_device);
+  arma::mat search_eta(G, N_em);
+  arma::cube search_beta(G, k, N_em);
+  arma::mat search_phi(G, N_em);
+  arma::vec search_loglik(N_em);
+  int best = 0;
+  
+  EMSearchWorker worker(G, t, delta, X, Niter_em, search_seed, search_eta, search_beta, search_phi, search_loglik);
+  run_tasks(worker, N_em, true);
+  
+  for (int init = 0; init < N_em; init++) {
+    if (init == 0) {
+      if (show_output) {
+        Rcout << "Initial LogLik: " << search_loglik(0) << "\n";
+      }
+    } else if (search_loglik(init) > search_loglik(best)) { // comparing logliks
+      if (show_output) {
+        Rcout << "Previous maximum: " << search_loglik(best) << " | New maximum: " << search_loglik(init) << "\n";
       }
+      best = init;
     }
   }
   
-  return loglik;
+  eta = search_eta.col(best);
+  beta = search_beta.slice(best);
+  phi = search_phi.col(best);
 }
 
-// EM for the lognormal mixture model.
-arma::field<arma::mat> lognormal_mixture_em(const int& Niter, const int& G, const arma::vec& t, const arma::ivec& delta, const arma::mat& X,
+// EM for the lognormal mixture model, on data partitioned by partition_by_status.
+// If start_params (eta, beta and phi) is
+// not empty, the EM starts from it, e.g. the parameters of a previous fit,
+// skipping the search for initial values. If tol > 0, the EM stops once the
+// relative change of the parameters in an iteration is below tol. If squarem,
+// each iteration is a SQUAREM cycle of two or more EM updates. With internal =
+// false, it returns the iterations done, the log-likelihood, the relative
+// change of the parameters in each iteration and the number of EM updates.
+template <typename MatType>
+arma::field<arma::mat> lognormal_mixture_em(const int& Niter, const int& G, const arma::vec& t, const arma::ivec& delta, const MatType& X,
                                             const bool& better_initial_values, const int& N_em,
-                                            const int& Niter_em, const bool& internal, const bool& show_output, std::mt19937& rng_device) {
+                                            const int& Niter_em, const bool& internal, const bool& show_output, Philox4x32& rng_device,
+                                            const arma::field<arma::mat>& start_params, const double& tol, const bool& squarem) {
   
   int n = X.n_rows;
   int k = X.n_cols;
@@ -342,58 +942,64 @@ arma::field<arma::mat> lognormal_mixture_em(const int& Niter, const int& G, cons
   arma::vec z(n);
   arma::mat W(n, G);
   arma::mat beta(G, k);
-  arma::mat mean(n, k);
+  arma::mat mean(n, G);
   arma::mat out(Niter, G * k + (G * 2));
   arma::uvec censored_indexes = arma::find(delta == 0); // finding which observations are censored
+  int n_events = n - censored_indexes.n_elem;
   arma::vec colg(n);
-  arma::sp_mat Wg;
+  arma::cube XtWX(k, k, G);
+  arma::mat XtWz(k, G);
   arma::field<arma::mat> out_internal_true(6);
-  arma::field<arma::mat> out_internal_false(2);
-  arma::field<arma::mat> em_params(6);
-  arma::field<arma::mat> best_em(6);
-  arma::mat mat_denom(n, G);
-  arma::rowvec repl_vec = repl(1.0 / G, G).t();
+  arma::field<arma::mat> out_internal_false(4);
+  arma::vec trace(Niter);
+  int n_iter = Niter;
+  int em_updates = 0;
+  double loglik = arma::datum::nan; // observed log-likelihood kept by SQUAREM
+  arma::mat W_loglik;
+  
+  if(squarem) {
+    W_loglik.set_size(n, G);
+  }
+  
+  trace(0) = arma::datum::nan;
   
   for(int iter = 0; iter < Niter; iter++) {
     if(iter == 0) { // sample starting values
       
-      if(better_initial_values) {
-        for (int init = 0; init < N_em; init ++) {
-          em_params = lognormal_mixture_em(Niter_em, G, t, delta, X, false, 0, 0, true, false, rng_device);
-          
-          if(init == 0) {
-            best_em = em_params;
-            if(show_output) {
-              Rcout << "Initial LogLik: " << arma::as_scalar(best_em(5)) << "\n";
-            }
-          } else {
-            if(arma::as_scalar(em_params(5)) > arma::as_scalar(best_em(5))) { // comparing logliks
-              if(show_output) {
-                Rcout << "Previous maximum: " << arma::as_scalar(best_em(5)) << " | New maximum: " << arma::as_scalar(em_params(5))  << "\n";
-              }
-              best_em = em_params;
-            }
-          }
+      if(start_params.n_elem > 0) {
+        eta = start_params(0);
+        beta = start_params(1);
+        phi = start_params(2);
+        sd = 1.0 / sqrt(phi);
+        mean = X * beta.t();
+        e_step_em(y, mean, eta, sd, n_events, false, W);
+        
+        if(show_output) {
+          Rcout << "Starting EM with the given initial values" << "\n";
         }
+      } else if(better_initial_values) {
+        search_initial_values_em(G, t, delta, X, N_em, Niter_em, show_output, rng_device, eta, beta, phi);
+        sd = 1.0 / sqrt(phi);
+        mean = X * beta.t();
+        e_step_em(y, mean, eta, sd, n_events, false, W);
         
-        eta = best_em(0);
-        beta = best_em(1);
-        phi = best_em(2);
-        W = best_em(3);
         if(show_output) {
           Rcout << "Starting EM with better initial values" << "\n";
         }
       } else {
         sample_initial_values_em(eta, phi, beta, sd, G, k, rng_device);
-        W = compute_W(y, X, eta, beta, sd, G, n, denom, mat_denom, repl_vec);
+        mean = X * beta.t();
+        e_step_em(y, mean, eta, sd, n_events, false, W);
       }
       
     } else {
-      mean = X * beta.t();
-      sd = 1.0 / sqrt(phi);
-      z = augment_em(y, censored_indexes, X, beta, sd, W, G, mean, n);
-      W = compute_W(z, X, eta, beta, sd, G, n, denom, mat_denom, repl_vec);
-      update_em_parameters(n, G, eta, beta, phi, W, X, y, z, censored_indexes, sd, rng_device, quant, denom, alpha, Wg, colg);
+      if(squarem) {
+        em_updates += squarem_iteration(n, G, y, n_events, X, censored_indexes, eta, beta, phi, W, sd, z, mean, rng_device,
+                                        quant, denom, alpha, XtWX, XtWz, colg, loglik, W_loglik);
+      } else {
+        em_iteration(n, G, y, n_events, X, censored_indexes, eta, beta, phi, W, sd, z, mean, rng_device, quant, denom, alpha, XtWX, XtWz, colg);
+        em_updates++;
+      }
       
       if(show_output) {
         if((iter + 1) % 20 == 0) {
@@ -416,37 +1022,407 @@ arma::field<arma::mat> lognormal_mixture_em(const int& Niter, const int& G, cons
                         phi.row(g));
     }
     
-    out.row(iter) = newRow;
+    out.row(iter) = newRow;
+    
+    if(iter > 0) {
+      trace(iter) = arma::norm(newRow - out.row(iter - 1)) / std::max(arma::norm(out.row(iter - 1)), 1e-10);
+      
+      if(tol > 0.0 && trace(iter) < tol) {
+        n_iter = iter + 1;
+        
+        if(show_output) {
+          Rcout << "EM converged after " << n_iter << " iterations" << "\n";
+        }
+        
+        break;
+      }
+    }
+  }
+  
+  mean = X * beta.t();
+  sd = 1.0 / sqrt(phi);
+  
+  if(internal) {
+    out_internal_true(0) = eta;
+    out_internal_true(1) = beta;
+    out_internal_true(2) = phi;
+    out_internal_true(3) = W;
+    out_internal_true(4) = augment_em(y, censored_indexes, X, beta, sd, W, G, mean, n);
+    out_internal_true(5) = e_step_em(y, mean, eta, sd, n_events, true, W);
+    
+    return out_internal_true;
+  } else {
+    out_internal_false(0) = out.rows(0, n_iter - 1);
+    out_internal_false(1) = e_step_em(y, mean, eta, sd, n_events, true, W);
+    out_internal_false(2) = trace.head(n_iter);
+    out_internal_false(3) = em_updates;
+    
+    return out_internal_false;
+  }
+  
+  return out_internal_false; // should never be reached
+}
+
+/* Auxiliary functions for the mini-batch EM */
+
+// Decay of the step sizes (k + 1)^(-MINIBATCH_EM_DECAY) of the mini-batch EM,
+// in (0.5, 1] so that the steps sum to infinity while their squares don't
+const double MINIBATCH_EM_DECAY = 0.6;
+
+// Running sufficient statistics of the mini-batch EM, as averages per
+// observation. For each group g: the mean weight (s0), and the mean of the
+// weights times x x' (S_xx), x E[z] (S_xz) and E[z^2] (S_zz), where z is the
+// log-time, replaced by its conditional moments when censored.
+struct EMStats {
+  arma::vec s0;
+  arma::cube S_xx;
+  arma::mat S_xz;
+  arma::vec S_zz;
+  
+  EMStats(const int& G, const int& k) :
+    s0(G, arma::fill::zeros), S_xx(k, k, G, arma::fill::zeros),
+    S_xz(k, G, arma::fill::zeros), S_zz(G, arma::fill::zeros) {}
+};
+
+// E-step of the observation i (censored if i >= n_events), whose means in
+// the groups are mean_i: the weights of the groups (on the censored
+// likelihood) and the first two moments of z given each group. w, z1 and z2
+// have G elements. Returns the log-likelihood of the observation, as e_step_em.
+double e_step_row(const int& i, const arma::vec& y, const int& n_events, const arma::rowvec& mean_i,
+                  const arma::vec& log_eta, const arma::vec& sd,
+                  const int& G, double* w, double* z1, double* z2) {
+  double max_lp = -arma::datum::inf;
+  double total = 0.0;
+  
+  for (int g = 0; g < G; g++) {
+    double mean = mean_i(g);
+    
+    if (i < n_events) {
+      w[g] = log_eta(g) + normal_log_pdf((y(i) - mean) / sd(g)) - std::log(sd(g));
+      z1[g] = y(i);
+      z2[g] = y(i) * y(i);
+    } else {
+      double alpha = (y(i) - mean) / sd(g);
+      double log_surv = normal_log_upper_cdf(alpha);
+      double mills = normal_inverse_mills_ratio(alpha);
+      
+      w[g] = log_eta(g) + log_surv;
+      z1[g] = mean + sd(g) * mills;
+      z2[g] = sd(g) * sd(g) * (1.0 + alpha * mills - mills * mills) + z1[g] * z1[g];
+    }
+    
+    if (w[g] > max_lp) {
+      max_lp = w[g];
+    }
+  }
+  
+  if (!std::isfinite(max_lp)) { // degenerated case, every group is equally likely
+    std::fill(w, w + G, 1.0 / G);
+    return max_lp;
+  }
+  
+  for (int g = 0; g < G; g++) {
+    w[g] = std::exp(w[g] - max_lp);
+    total += w[g];
+  }
+  
+  for (int g = 0; g < G; g++) {
+    w[g] /= total;
+  }
+  
+  return max_lp + std::log(total);
+}
+
+// Moves the running statistics a step gamma towards the statistics of a
+// mini-batch of batch_size observations sampled with replacement: the
+// statistics are scaled by 1 - gamma once, then each row adds its share
+// straight to them. Only O(batch_size) time and O(G + k) extra memory (the
+// buffers of a row, allocated once) are used, whatever the number of
+// observations. Only the products of the nonzero covariates of each row are
+// accumulated. The rows are read from X_rows.
+template <typename MatType>
+void update_em_stats(EMStats& stats, const double& gamma, const int& batch_size,
+                     const arma::vec& y, const int& n_events, const DesignRows<MatType>& X_rows,
+                     const arma::vec& eta, const arma::mat& beta, const arma::vec& sd,
+                     const int& G, Philox4x32& rng_device) {
+  int n = X_rows.n_rows();
+  int k = X_rows.n_cols();
+  double scale = gamma / batch_size;
+  arma::vec log_eta = arma::log(eta);
+  arma::vec w(G), z1(G), z2(G);
+  arma::rowvec x_row(k);
+  arma::rowvec mean_i(G);
+  arma::uvec nonzero(k);
+  
+  stats.s0 *= 1.0 - gamma;
+  stats.S_xx *= 1.0 - gamma;
+  stats.S_xz *= 1.0 - gamma;
+  stats.S_zz *= 1.0 - gamma;
+  
+  for (int b = 0; b < batch_size; b++) {
+    int i = runif_index(n, rng_device);
+    int n_nonzero = 0;
+    
+    X_rows.read(i, x_row);
+    
+    for (int j = 0; j < k; j++) {
+      if (x_row(j) != 0.0) {
+        nonzero(n_nonzero++) = j;
+      }
+    }
+    
+    for (int g = 0; g < G; g++) {
+      mean_i(g) = 0.0;
+      
+      for (int a = 0; a < n_nonzero; a++) {
+        mean_i(g) += x_row(nonzero(a)) * beta(g, nonzero(a));
+      }
+    }
+    
+    e_step_row(i, y, n_events, mean_i, log_eta, sd, G, w.memptr(), z1.memptr(), z2.memptr());
+    
+    for (int g = 0; g < G; g++) {
+      double w_g = scale * w(g);
+      double* S_xx_g = stats.S_xx.slice_memptr(g);
+      
+      stats.s0(g) += w_g;
+      stats.S_zz(g) += w_g * z2(g);
+      
+      for (int a = 0; a < n_nonzero; a++) {
+        double x_a = x_row(nonzero(a));
+        
+        stats.S_xz(nonzero(a), g) += w_g * z1(g) * x_a;
+        
+        for (int c = 0; c < n_nonzero; c++) {
+          S_xx_g[nonzero(c) + nonzero(a) * k] += w_g * x_a * x_row(nonzero(c));
+        }
+      }
+    }
+  }
+}
+
+// M-step from the running statistics, with the same safeguards of the full EM
+void update_em_parameters_stats(const EMStats& stats, const int& G, arma::vec& eta, arma::mat& beta,
+                                arma::vec& phi, Philox4x32& rng_device) {
+  eta = stats.s0 / arma::sum(stats.s0);
+  
+  if (arma::any(eta == 0.0) || eta.has_nan()) { // if there's a group with no observations
+    eta = rdirichlet(repl(1.0, G), rng_device);
+  }
+  
+  for (int g = 0; g < G; g++) {
+    arma::vec beta_g;
+    
+    if (solve_wls(stats.S_xx.slice(g), stats.S_xz.col(g), beta_g)) {
+      beta.row(g) = beta_g.t();
+    }
+    
+    arma::vec b = beta.row(g).t();
+    double quant = stats.S_zz(g) - 2.0 * arma::dot(b, stats.S_xz.col(g)) +
+      arma::as_scalar(b.t() * stats.S_xx.slice(g) * b);
+    
+    phi(g) = stats.s0(g) / quant;
+    
+    // to avoid numerical problems
+    if (!(quant > 0.0) || !std::isfinite(phi(g)) || phi(g) > 1e5) {
+      phi(g) = rgamma_(0.5, 0.5, rng_device); // resample phi
+    }
+  }
+}
+
+// Stochastic (mini-batch) EM for the lognormal mixture model (Cappé and
+// Moulines, 2009). Each iteration updates the running sufficient statistics
+// with a random mini-batch of batch_size observations and a decreasing step,
+// followed by the M-step, so it costs the same whatever the number of
+// observations and never stores the n x G weights. Returns the same as
+// lognormal_mixture_em with internal = false (without stopping early); the
+// final log-likelihood is the only pass over all the observations. The
+// candidates of the search for initial values are compared on a common
+// mini-batch. The data must be partitioned by partition_by_status.
+template <typename MatType>
+arma::field<arma::mat> lognormal_mixture_em_minibatch(const int& Niter, const int& G, const arma::vec& t, const arma::ivec& delta,
+                                                      const MatType& X, const int& batch_size,
+                                                      const bool& better_initial_values, const int& N_em,
+                                                      const int& Niter_em, const bool& show_output, Philox4x32& rng_device,
+                                                      const arma::field<arma::mat>& start_params) {
+  int n = X.n_rows;
+  int k = X.n_cols;
+  int n_events = n - arma::accu(delta == 0);
+  
+  arma::vec y = log(t);
+  arma::vec eta(G);
+  arma::vec phi(G);
+  arma::vec sd(G);
+  arma::mat beta(G, k);
+  arma::mat out(Niter, G * k + (G * 2));
+  arma::field<arma::mat> out_minibatch(4);
+  arma::vec trace(Niter);
+  arma::vec w(G), z1(G), z2(G);
+  arma::rowvec x_row(k);
+  EMStats stats(G, k);
+  DesignRows<MatType> X_rows(X);
+  
+  for (int iter = 0; iter < Niter; iter++) {
+    if (iter == 0) { // sample starting values
+      if (start_params.n_elem > 0) {
+        eta = start_params(0);
+        beta = start_params(1);
+        phi = start_params(2);
+        
+        if (show_output) {
+          Rcout << "Starting EM with the given initial values" << "\n";
+        }
+      } else if (better_initial_values) {
+        arma::ivec search_rows(batch_size);
+        arma::mat X_search(batch_size, k);
+        arma::mat mean_search;
+        double best_loglik = -arma::datum::inf;
+        arma::vec eta_init(G), phi_init(G), sd_init(G);
+        arma::mat beta_init(G, k);
+        
+        for (int b = 0; b < batch_size; b++) {
+          search_rows(b) = runif_index(n, rng_device);
+          X_rows.read(search_rows(b), x_row);
+          X_search.row(b) = x_row;
+        }
+        
+        for (int init = 0; init < N_em; init++) {
+          EMStats init_stats(G, k);
+          sample_initial_values_em(eta_init, phi_init, beta_init, sd_init, G, k, rng_device);
+          
+          for (int init_iter = 1; init_iter < Niter_em; init_iter++) {
+            update_em_stats(init_stats, std::pow(init_iter, -MINIBATCH_EM_DECAY), batch_size, y, n_events, X_rows,
+                            eta_init, beta_init, 1.0 / sqrt(phi_init), G, rng_device);
+            update_em_parameters_stats(init_stats, G, eta_init, beta_init, phi_init, rng_device);
+          }
+          
+          double loglik = 0.0;
+          arma::vec log_eta_init = log(eta_init);
+          sd_init = 1.0 / sqrt(phi_init);
+          mean_search = X_search * beta_init.t();
+          
+          for (int b = 0; b < batch_size; b++) {
+            loglik += e_step_row(search_rows(b), y, n_events, mean_search.row(b), log_eta_init, sd_init, G, w.memptr(), z1.memptr(), z2.memptr());
+          }
+          
+          if (init == 0 || loglik > best_loglik) {
+            if (show_output) {
+              if (init == 0) {
+                Rcout << "Initial LogLik: " << loglik << "\n";
+              } else {
+                Rcout << "Previous maximum: " << best_loglik << " | New maximum: " << loglik << "\n";
+              }
+            }
+            
+            best_loglik = loglik;
+            eta = eta_init;
+            beta = beta_init;
+            phi = phi_init;
+          }
+        }
+        
+        if (show_output) {
+          Rcout << "Starting EM with better initial values" << "\n";
+        }
+      } else {
+        sample_initial_values_em(eta, phi, beta, sd, G, k, rng_device);
+      }
+    } else {
+      // the first step (gamma = 1) replaces the empty statistics by the mini-batch ones
+      sd = 1.0 / sqrt(phi);
+      update_em_stats(stats, std::pow(iter, -MINIBATCH_EM_DECAY), batch_size, y, n_events, X_rows, eta, beta, sd, G, rng_device);
+      update_em_parameters_stats(stats, G, eta, beta, phi, rng_device);
+      
+      if (show_output) {
+        if ((iter + 1) % 20 == 0) {
+          Rcout << "EM Iter: " << (iter + 1) << " | " << Niter << "\n";
+        }
+      }
+    }
+    
+    // Fill the out matrix
+    for (int g = 0; g < G; g++) {
+      int col = g * (k + 2);
+      
+      out(iter, col) = eta(g);
+      out.submat(iter, col + 1, iter, col + k) = beta.row(g);
+      out(iter, col + k + 1) = phi(g);
+    }
+    
+    if (iter > 0) {
+      trace(iter) = arma::norm(out.row(iter) - out.row(iter - 1)) / std::max(arma::norm(out.row(iter - 1)), 1e-10);
+    }
   }
   
-  mean = X * beta.t();
+  double loglik = 0.0;
+  arma::vec log_eta = log(eta);
+  arma::mat mean_block;
+  sd = 1.0 / sqrt(phi);
   
-  if(internal) {
-    out_internal_true(0) = eta;
-    out_internal_true(1) = beta;
-    out_internal_true(2) = phi;
-    out_internal_true(3) = W;
-    out_internal_true(4) = augment_em(y, censored_indexes, X, beta, 1.0 / sqrt(phi), W, G, mean, n);
-    out_internal_true(5) = loglik_em(eta, 1.0 / sqrt(phi), compute_W(y, X, eta, beta, 1.0 / sqrt(phi), G, n, denom, mat_denom, repl_vec), y, G, n, mean, censored_indexes);
+  // the means are computed by blocks of rows, so their memory doesn't grow with n
+  for (int first = 0; first < n; first += OBS_BLOCK_SIZE) {
+    int last = std::min(first + OBS_BLOCK_SIZE, n) - 1;
+    mean_block = X.rows(first, last) * beta.t();
     
-    return out_internal_true;
-  } else {
-    out_internal_false(0) = out;
-    out_internal_false(1) = loglik_em(eta, 1.0 / sqrt(phi), compute_W(y, X, eta, beta, 1.0 / sqrt(phi), G, n, denom, mat_denom, repl_vec), y, G, n, mean, censored_indexes);
+    for (int i = first; i <= last; i++) {
+      loglik += e_step_row(i, y, n_events, mean_block.row(i - first), log_eta, sd, G, w.memptr(), z1.memptr(), z2.memptr());
+    }
+  }
+  
+  trace(0) = arma::datum::nan;
+  
+  out_minibatch(0) = out;
+  out_minibatch(1) = loglik;
+  out_minibatch(2) = trace;
+  out_minibatch(3) = Niter - 1;
+  
+  return out_minibatch;
+}
+
+// Transposed means matrix (G x n) of the Gibbs sampler, in the precision of Xt
+arma::mat gibbs_means(const arma::mat& beta, const arma::mat& Xt) {
+  return beta * Xt;
+}
+
+arma::mat gibbs_means(const arma::mat& beta, const arma::sp_mat& Xt) {
+  return beta * Xt;
+}
+
+// In single precision each mean is accumulated in double and then stored as
+// float (without a product of float matrices, which R's BLAS doesn't have)
+arma::fmat gibbs_means(const arma::mat& beta, const arma::fmat& Xt) {
+  int G = beta.n_rows;
+  int p = Xt.n_rows;
+  int n = Xt.n_cols;
+  arma::fmat means_t(G, n);
+  const float* x;
+  double m;
+  
+  for (int i = 0; i < n; i++) {
+    x = Xt.colptr(i);
     
-    return out_internal_false;
+    for (int g = 0; g < G; g++) {
+      m = 0.0;
+      
+      for (int c = 0; c < p; c++) {
+        m += beta(g, c) * x[c];
+      }
+      
+      means_t(g, i) = m;
+    }
   }
   
-  return out_internal_false; // should never be reached
+  return means_t;
 }
 
 // Setting parameter's values for the first Gibbs iteration
+template <typename MatType>
 void first_iter_gibbs(const arma::field<arma::mat>& em_params, arma::vec& eta,
                       arma::mat& beta, arma::vec& phi, const int& em_iter,
                       const int& G, const arma::vec& y,
                       arma::vec& sd, arma::ivec& groups, 
-                      const arma::mat& X, const arma::ivec& delta,
-                      std::mt19937& rng_device) {
+                      const MatType& X, const arma::ivec& delta,
+                      Philox4x32& rng_device) {
   if (em_iter != 0) {
     // we are going to start the values using the last EM iteration
     eta = em_params(0);
@@ -471,8 +1447,37 @@ void first_iter_gibbs(const arma::field<arma::mat>& em_params, arma::vec& eta,
   }
 }
 
+// Setting the groups for the first Gibbs iteration of a warm start: the
+// observations already seen by the previous fit keep their labels in
+// groups_seen and the new ones, marked with -1, are sampled given the
+// parameters of that fit.
+template <typename MatType>
+void first_iter_warm_start(const arma::ivec& groups_seen, const arma::vec& eta,
+                           const arma::mat& beta, const arma::vec& phi,
+                           const int& G, const arma::vec& y, arma::vec& sd,
+                           arma::ivec& groups, const MatType& Xt,
+                           const int& n_events, Philox4x32& rng_device) {
+  int N = y.n_elem;
+  arma::Mat<typename MatType::elem_type> means_t = gibbs_means(beta, Xt);
+  arma::vec lp(G);
+  
+  sd = 1.0 / sqrt(phi);
+  arma::vec inv_sd = sqrt(phi);
+  arma::vec log_sd = arma::log(sd);
+  arma::vec log_eta = arma::log(eta);
+  
+  groups = groups_seen;
+  
+  for (int i = 0; i < N; i++) {
+    if (groups(i) < 0) {
+      sample_groups(G, y, log_eta, inv_sd, log_sd, groups, false, means_t, n_events,
+                    rng_device, lp.memptr(), i, i + 1);
+    }
+  }
+}
+
 // Avoiding groups with zero number of observations in it (causes numerical issues)
-void avoid_group_with_zero_allocation(arma::ivec& n_groups, arma::ivec& groups, const int& G, const int& N, std::mt19937& rng_device) {
+void avoid_group_with_zero_allocation(arma::ivec& n_groups, arma::ivec& groups, const int& G, const int& N, Philox4x32& rng_device) {
   int idx = 0;
   int m;
   
@@ -480,9 +1485,7 @@ void avoid_group_with_zero_allocation(arma::ivec& n_groups, arma::ivec& groups,
     if(n_groups(g) == 0) {
       m = 0;
       while(m < 5) {
-        idx = numeric_sample(seq(0, N),
-                             repl(1.0 / N, N),
-                             rng_device);
+        idx = runif_index(N, rng_device);
         
         if(n_groups(groups(idx)) > 5) {
           groups(idx) = g;
@@ -496,40 +1499,41 @@ void avoid_group_with_zero_allocation(arma::ivec& n_groups, arma::ivec& groups,
   }
 }
 
-double update_phi_g_gibbs(const int& n_groups_g, const arma::vec& linearComb, std::mt19937& rng_device) {
-  return rgamma_(static_cast<double>(n_groups_g)  / 2.0 + 0.01, (1.0 / 2.0) * arma::as_scalar(linearComb.t() * linearComb) + 0.01, rng_device);
+double update_phi_g_gibbs(const int& n_groups_g, const double& ssr, Philox4x32& rng_device) {
+  return rgamma_(static_cast<double>(n_groups_g)  / 2.0 + 0.01, (1.0 / 2.0) * ssr + 0.01, rng_device);
 }
 
-arma::rowvec update_beta_g_gibbs(const double& phi_g, const arma::mat& Xg, const arma::mat& Xgt, const arma::vec& yg, std::mt19937& rng_device) {
-  arma::rowvec out;
-  arma::mat comb = phi_g * Xgt * Xg + arma::diagmat(repl(1.0 / 1000.0, Xg.n_cols));
-  arma::mat Sg;
-  arma::vec mg;
-  
-  if(arma::det(comb) != 0) {
-    if(arma::det(makeSymmetric(comb)) < 1e-10) { // regularization if matrix is poorly conditioned
-      comb += 1e-8 * arma::eye(Xg.n_cols, Xg.n_cols);
-    }
+// Samples beta_g from its full conditional N(Q^{-1} b, Q^{-1}), with precision
+// Q = phi_g X_g' X_g + I / 1000 and b = phi_g X_g' y_g. If Q is numerically
+// singular, it is regularized, and if it still can't be factorized the current
+// value of beta_g is kept.
+arma::rowvec update_beta_g_gibbs(const double& phi_g, const arma::mat& XtX_g, const arma::vec& Xty_g,
+                                 const arma::rowvec& beta_g, Philox4x32& rng_device) {
+  int p = XtX_g.n_cols;
+  arma::mat comb = phi_g * XtX_g;
+  arma::vec out;
+  
+  comb.diag() += 1.0 / 1000.0;
+  
+  if(!rmvnorm_precision(out, phi_g * Xty_g, comb, rng_device)) {
+    // regularization if matrix is poorly conditioned
+    comb.diag() += 1e-8 * std::max(1.0, arma::trace(comb) / p);
     
-    Sg = arma::solve(makeSymmetric(comb),
-                     arma::eye(Xg.n_cols, Xg.n_cols),
-                     arma::solve_opts::likely_sympd);
-    mg = phi_g * (Sg * Xgt * yg);
-    out = rmvnorm(mg, Sg, rng_device).t();
+    if(!rmvnorm_precision(out, phi_g * Xty_g, comb, rng_device)) {
+      return beta_g;
+    }
   }
   
-  return out;
+  return out.t();
 }
 
 // update all the Gibbs parameters
-void update_gibbs_parameters(const int& G, const arma::mat& X, const arma::vec& y_aug, const arma::ivec& n_groups, const arma::ivec& groups, 
-                             arma::vec& eta, arma::mat& beta, arma::vec& phi, std::mt19937& rng_device) {
+void update_gibbs_parameters(const int& G, const GroupStats& stats, const arma::ivec& n_groups,
+                             arma::vec& eta, arma::mat& beta, arma::vec& phi, Philox4x32& rng_device) {
   
-  arma::mat Xg;
-  arma::mat Xgt;
-  arma::vec yg;
-  arma::vec linearComb;
-  arma::uvec indexg;
+  arma::mat XtX_g;
+  arma::vec beta_g;
+  double ssr;
   
   // updating eta
   eta = rdirichlet(arma::conv_to<arma::Col<double>>::from(n_groups) + 150.0, 
@@ -537,48 +1541,82 @@ void update_gibbs_parameters(const int& G, const arma::mat& X, const arma::vec&
   
   // For each g, sample new phi[g] and beta[g, _]
   for (int g = 0; g < G; g++) {
-    indexg = arma::find(groups == g);
-    Xg = X.rows(indexg);
-    Xgt = Xg.t();
-    yg = y_aug(indexg);
-    linearComb = yg - Xg * beta.row(g).t();
+    XtX_g = arma::symmatu(stats.XtX.slice(g));
+    beta_g = beta.row(g).t();
+    
+    // residual sum of squares (y_g - X_g beta_g)'(y_g - X_g beta_g) expanded
+    // in terms of the sufficient statistics
+    ssr = stats.yty(g) - 2.0 * arma::dot(beta_g, stats.Xty.col(g)) +
+      arma::as_scalar(beta_g.t() * XtX_g * beta_g);
+    
+    if (ssr < 0.0) { // cancellation error
+      ssr = 0.0;
+    }
     
     // updating phi(g)
     // the priori used was Gamma(0.01, 0.01)
-    phi(g) = update_phi_g_gibbs(n_groups(g), linearComb, rng_device);
+    phi(g) = update_phi_g_gibbs(n_groups(g), ssr, rng_device);
     
     // updating beta.row(g)
     // the priori used was MNV(vec 0, diag 1000)
-    beta.row(g) = update_beta_g_gibbs(phi(g), Xg, Xgt, yg, rng_device);
+    beta.row(g) = update_beta_g_gibbs(phi(g), XtX_g, stats.Xty.col(g), beta.row(g), rng_device);
+  }
+}
+
+// Log-likelihood of the observations of a group, up to a constant, given their
+// residuals (log-times minus the group means) and the group precision phi.
+// The first n_events rows are events and the others are censored, which use the
+// survival function on the log scale, so rows deep in the tail don't underflow
+// to log(0).
+double loglik_group_augF(const arma::vec& linearComb, const int& n_events, const double& phi) {
+  double sqrt_phi = sqrt(phi);
+  int n = linearComb.n_elem;
+  double out = 0.0;
+  
+  if(n_events > 0) {
+    out += (1.0 / 2.0) * n_events * log(phi) - (phi / 2.0) * arma::dot(linearComb.head(n_events), linearComb.head(n_events));
+  }
+  
+  if(n_events < n) {
+    arma::vec log_S = sqrt_phi * linearComb.tail(n - n_events);
+    
+    normal_log_upper_cdf(log_S.memptr(), log_S.memptr(), log_S.n_elem);
+    out += arma::accu(log_S);
   }
+  
+  return out;
 }
 
+// Number of events among the observations in indexes (sorted), for data
+// partitioned by partition_by_status
+int count_events(const arma::uvec& indexes, const int& n_events) {
+  return std::lower_bound(indexes.begin(), indexes.end(), static_cast<arma::uword>(n_events)) - indexes.begin();
+}
+
+// loglik is the log-likelihood of the group at phi_actual and is updated to the
+// log-likelihood at the returned value, so only the proposal is evaluated
 double update_phi_g_gibbs_augF(const double& phi_actual, const arma::vec& linearComb,
-                               std::mt19937& rng_device, const arma::ivec& delta,
-                               double& proposal_var, double& adapt_rate, const double& t) {
+                               Philox4x32& rng_device, const int& n_events,
+                               double& proposal_var, double& adapt_rate, const double& t,
+                               double& loglik) {
   double psi_actual = log(phi_actual);
   double lambda = log(proposal_var);
   double psi_prop = rnorm_(psi_actual, proposal_var, rng_device);
   double phi_prop = exp(psi_prop);
   double a0 = 0.01;
   double b0 = 0.01;
-  double dccp_actual = (a0 - 1) * psi_actual - b0 * phi_actual;
-  double dccp_prop = (a0 - 1) * psi_prop - b0 * phi_prop;
+  double loglik_prop = loglik_group_augF(linearComb, n_events, phi_prop);
+  double dccp_actual = (a0 - 1) * psi_actual - b0 * phi_actual + loglik;
+  double dccp_prop = (a0 - 1) * psi_prop - b0 * phi_prop + loglik_prop;
   double decision;
   double decision_outcome; // 1 if proposed value is accepted, 0 otherwise
   
-  for(int i = 0; i < linearComb.n_elem; i++) {
-    dccp_actual += (delta(i) == 1) * ((1.0/2.0) * psi_actual - (phi_actual/2) * square(linearComb(i))) +
-      (delta(i) == 0) * log(S(sqrt(phi_actual) * linearComb(i), 0.0, 1.0));
-    dccp_prop += (delta(i) == 1) * ((1.0/2.0) * psi_prop - (phi_prop/2) * square(linearComb(i))) +
-      (delta(i) == 0) * log(S(sqrt(phi_prop) * linearComb(i), 0.0, 1.0));
-  }
-  
   double log_alpha = dccp_prop - dccp_actual + psi_prop - psi_actual;
   
   if(log(runif_0_1(rng_device)) < log_alpha) {
     decision = phi_prop;
     decision_outcome = 1.0;
+    loglik = loglik_prop;
   } else {
     decision = phi_actual;
     decision_outcome = 0.0;
@@ -591,33 +1629,38 @@ double update_phi_g_gibbs_augF(const double& phi_actual, const arma::vec& linear
   return decision;
 }
 
-arma::rowvec update_beta_g_gibbs_augF(const arma::rowvec beta_actual, const double& phi, const arma::mat& X,
-                                      const arma::vec& y, std::mt19937& rng_device, const arma::ivec& delta,
+// linear_actual and loglik are the residuals and log-likelihood of the group
+// at beta_actual, and are updated to the ones at the returned value
+template <typename MatType>
+arma::rowvec update_beta_g_gibbs_augF(const arma::rowvec beta_actual, const double& phi, const MatType& X,
+                                      const arma::vec& y, Philox4x32& rng_device, const int& n_events,
                                       double& proposal_var, double& adapt_rate, const double& t,
-                                      const arma::vec& linear_actual) {
+                                      arma::vec& linear_actual, double& loglik) {
   
   int p = beta_actual.n_elem;
-  arma::mat Sigma0 = arma::diagmat(repl(1.0/1000.0, p));
-  arma::rowvec beta_prop = rmvnorm(beta_actual.t(), arma::diagmat(repl(proposal_var, p)), rng_device).t();
+  arma::rowvec beta_prop(p);
+  
+  // proposal from MNV(beta_actual, diag proposal_var), drawn coordinate-wise
+  for(int j = 0; j < p; j++) {
+    beta_prop(j) = rnorm_(beta_actual(j), sqrt(proposal_var), rng_device);
+  }
+  
   arma::vec linear_prop = y - X * beta_prop.t();
+  double loglik_prop = loglik_group_augF(linear_prop, n_events, phi);
   
   double decision_outcome;
   arma::rowvec decision;
   double lambda = log(proposal_var);
   
-  double dccp_actual = -(1.0 / 2.0) * arma::as_scalar(beta_actual * Sigma0 * beta_actual.t());
-  double dccp_prop = -(1.0 / 2.0) * arma::as_scalar(beta_prop * Sigma0 * beta_prop.t());
-  
-  for(int i = 0; i < X.n_rows; i++) {
-    dccp_actual += (delta(i) == 1) * ((1.0 / 2.0) * log(phi) - (phi / 2.0) * square(linear_actual(i))) +
-      (delta(i) == 0) * log(S(sqrt(phi) * linear_actual(i), 0.0, 1.0));
-    dccp_prop += (delta(i) == 1) * ((1.0 / 2.0) * log(phi) - (phi / 2.0) * square(linear_prop(i))) +
-      (delta(i) == 0) * log(S(sqrt(phi) * linear_prop(i), 0.0, 1.0));
-  }
+  // the priori used was MNV(vec 0, diag 1000)
+  double dccp_actual = -(1.0 / 2.0) * arma::dot(beta_actual, beta_actual) / 1000.0 + loglik;
+  double dccp_prop = -(1.0 / 2.0) * arma::dot(beta_prop, beta_prop) / 1000.0 + loglik_prop;
   
   if(log(runif_0_1(rng_device)) < dccp_prop - dccp_actual) {
     decision = beta_prop;
     decision_outcome = 1.0;
+    linear_actual = linear_prop;
+    loglik = loglik_prop;
   } else {
     decision = beta_actual;
     decision_outcome = 0.0;
@@ -630,16 +1673,18 @@ arma::rowvec update_beta_g_gibbs_augF(const arma::rowvec beta_actual, const doub
   return decision;
 }
 
-void update_gibbs_parameters_augF(const int& G, const arma::mat& X, const arma::vec& y, const arma::ivec& n_groups, const arma::ivec& groups, 
-                                  arma::vec& eta, arma::mat& beta, arma::vec& phi, std::mt19937& rng_device, const arma::ivec& delta,
+template <typename MatType>
+void update_gibbs_parameters_augF(const int& G, const MatType& X, const arma::vec& y, const arma::ivec& n_groups, const arma::ivec& groups, 
+                                  arma::vec& eta, arma::mat& beta, arma::vec& phi, Philox4x32& rng_device, const int& n_events,
                                   arma::vec& proposal_var_phi, arma::vec& adapt_rate_phi, arma::vec& proposal_var_beta, arma::vec& adapt_rate_beta,
                                   const double& t) {
   
-  arma::mat Xg;
+  MatType Xg;
   arma::vec yg;
   arma::vec linearComb;
   arma::uvec indexg;
-  arma::ivec deltag;
+  int n_events_g;
+  double loglik;
   
   // updating eta
   eta = rdirichlet(arma::conv_to<arma::Col<double>>::from(n_groups) + 1.5, 
@@ -648,65 +1693,322 @@ void update_gibbs_parameters_augF(const int& G, const arma::mat& X, const arma::
   // For each g, sample new phi[g] and beta[g, _]
   for (int g = 0; g < G; g++) {
     indexg = arma::find(groups == g);
-    Xg = X.rows(indexg);
+    Xg = design_rows(X, indexg);
     yg = y(indexg);
-    deltag = delta(indexg);
+    n_events_g = count_events(indexg, n_events);
+    
+    // the residuals and the log-likelihood of the group are computed once
+    // and kept up to date by the Metropolis steps
     linearComb = yg - Xg * beta.row(g).t();
+    loglik = loglik_group_augF(linearComb, n_events_g, phi(g));
     
     // updating phi(g)
     // the priori used was Gamma(0.01, 0.01)
-    phi(g) = update_phi_g_gibbs_augF(phi(g), linearComb, rng_device, deltag, proposal_var_phi(g), adapt_rate_phi(g), t);
+    phi(g) = update_phi_g_gibbs_augF(phi(g), linearComb, rng_device, n_events_g, proposal_var_phi(g), adapt_rate_phi(g), t, loglik);
     
     // updating beta.row(g)
     // the priori used was MNV(vec 0, diag 1000)
-    beta.row(g) = update_beta_g_gibbs_augF(beta.row(g), phi(g), Xg, yg, rng_device, deltag, proposal_var_beta(g), adapt_rate_beta(g), t, linearComb);
+    beta.row(g) = update_beta_g_gibbs_augF(beta.row(g), phi(g), Xg, yg, rng_device, n_events_g, proposal_var_beta(g), adapt_rate_beta(g), t, linearComb, loglik);
+  }
+}
+
+// Hamiltonian Monte Carlo (Neal, 2011, "MCMC using Hamiltonian dynamics") for
+// the non-augmented sampler, updating (beta_g, log phi_g) of each group jointly
+// with the gradient of the censored lognormal likelihood.
+
+// Length of the HMC trajectories, in units of the posterior scale
+const double HMC_TRAJECTORY_LENGTH = 1.5;
+
+// Maximum number of leapfrog steps in a trajectory
+const int HMC_MAX_STEPS = 100;
+
+// Target acceptance probability used to adapt the HMC step sizes
+const double HMC_TARGET_ACCEPTANCE = 0.65;
+
+// Log-posterior of theta = (beta_g, log phi_g) given the observations of the
+// group, up to a constant, with Gamma(0.01, 0.01) priori for phi_g (and the
+// jacobian of the log) and MNV(vec 0, diag 1000) for beta_g. Its gradient is
+// written on grad. The first n_events rows are events; the censored ones
+// contribute log S(sqrt(phi) r), whose derivative in z = sqrt(phi) r is minus
+// the hazard of the standard normal.
+template <typename MatType>
+double log_posterior_hmc(const arma::vec& theta, const MatType& X, const arma::vec& y,
+                         const int& n_events, arma::vec& grad) {
+  int p = X.n_cols;
+  double psi = theta(p);
+  double phi = exp(psi);
+  double sqrt_phi = exp(psi / 2.0);
+  double a0 = 0.01;
+  double b0 = 0.01;
+  arma::vec r = y - X * theta.head(p);
+  arma::vec w(r.n_elem); // derivative of the log-likelihood of each row in x_i' beta
+  int n = r.n_elem;
+  double grad_psi = a0 - b0 * phi;
+  double out = a0 * psi - b0 * phi - (1.0 / 2.0) * arma::dot(theta.head(p), theta.head(p)) / 1000.0;
+  
+  if(n_events > 0) {
+    double ssr = arma::dot(r.head(n_events), r.head(n_events));
+    
+    out += (1.0 / 2.0) * n_events * psi - (phi / 2.0) * ssr;
+    w.head(n_events) = phi * r.head(n_events);
+    grad_psi += (1.0 / 2.0) * n_events - (phi / 2.0) * ssr;
+  }
+  
+  if(n_events < n) {
+    arma::vec z = sqrt_phi * r.tail(n - n_events);
+    arma::vec log_S(z.n_elem);
+    arma::vec hazard(z.n_elem);
+    
+    normal_log_upper_cdf(z.memptr(), log_S.memptr(), z.n_elem);
+    normal_inverse_mills_ratio(z.memptr(), hazard.memptr(), z.n_elem);
+    
+    out += arma::accu(log_S);
+    w.tail(n - n_events) = sqrt_phi * hazard;
+    grad_psi -= (1.0 / 2.0) * arma::dot(z, hazard);
   }
+  
+  grad.set_size(p + 1);
+  grad.head(p) = X.t() * w - theta.head(p) / 1000.0;
+  grad(p) = grad_psi;
+  
+  return out;
 }
 
-// Internal implementation of the lognormal mixture model via Gibbs sampler
-arma::mat lognormal_mixture_gibbs_implementation(const int& Niter, const int& em_iter, const int& G, 
-                                                 const arma::vec& t, const arma::ivec& delta, 
-                                                 const arma::mat& X,
-                                                 long long int starting_seed,
-                                                 const bool& show_output, const int& chain_num,
-                                                 const bool& better_initial_values, const int& Niter_em,
-                                                 const int& N_em, const bool& data_augmentation) {
+// One HMC transition for (beta_g, log phi_g). The mass matrix is the expected
+// information at phi_scale, blockdiag(phi_scale X_g' X_g + I / 1000, n_g / 2), so
+// the dynamics are close to isotropic however correlated the covariates are.
+// phi_scale (a running mean of phi_g) and step_size are adapted with the same
+// vanishing rate used by the adaptive Metropolis steps.
+template <typename MatType>
+void update_group_hmc(arma::rowvec& beta_g, double& phi_g, const MatType& X, const arma::vec& y,
+                      const int& n_events, double& step_size, double& phi_scale,
+                      const double& t, Philox4x32& rng_device) {
+  int p = X.n_cols;
+  int n = X.n_rows;
+  arma::mat M(p + 1, p + 1, arma::fill::zeros);
+  arma::mat L;
   
-  std::mt19937 global_rng;
+  M.submat(0, 0, p - 1, p - 1) = phi_scale * arma::mat(X.t() * X);
+  M.diag() += 1.0 / 1000.0;
+  M(p, p) = std::max(n, 1) / 2.0;
   
-  // setting global seed to start the sampler
-  setSeed(starting_seed, global_rng);
+  if(!arma::chol(L, M, "lower")) {
+    M.diag() += 1e-8 * std::max(1.0, arma::trace(M) / (p + 1));
+    
+    if(!arma::chol(L, M, "lower")) {
+      return;
+    }
+  }
+  
+  arma::vec theta(p + 1);
+  theta.head(p) = beta_g.t();
+  theta(p) = log(phi_g);
+  
+  arma::vec grad;
+  double log_post = log_posterior_hmc(theta, X, y, n_events, grad);
+  
+  // momentum ~ N(0, M)
+  arma::vec z(p + 1);
+  for(int j = 0; j < p + 1; j++) {
+    z(j) = rnorm_(0.0, 1.0, rng_device);
+  }
+  arma::vec momentum = L * z;
+  double H_actual = -log_post + (1.0 / 2.0) * arma::dot(z, z);
+  
+  // jittering the step size avoids periodic trajectories
+  double eps = step_size * (0.8 + 0.4 * runif_0_1(rng_device));
+  int n_steps = std::min(HMC_MAX_STEPS, std::max(1, static_cast<int>(std::ceil(HMC_TRAJECTORY_LENGTH / eps))));
+  
+  arma::vec theta_prop = theta;
+  arma::vec grad_prop = grad;
+  double log_post_prop = log_post;
+  
+  // leapfrog integration, with velocities M^{-1} momentum from the Cholesky factor
+  momentum += (eps / 2.0) * grad_prop;
+  
+  for(int s = 0; s < n_steps; s++) {
+    theta_prop += eps * arma::solve(arma::trimatu(L.t()), arma::solve(arma::trimatl(L), momentum));
+    log_post_prop = log_posterior_hmc(theta_prop, X, y, n_events, grad_prop);
+    
+    if(!std::isfinite(log_post_prop)) {
+      break; // divergent trajectory, rejected below
+    }
+    
+    momentum += ((s == n_steps - 1) ? eps / 2.0 : eps) * grad_prop;
+  }
+  
+  double accept_prob = 0.0;
+  
+  if(std::isfinite(log_post_prop)) {
+    arma::vec v = arma::solve(arma::trimatl(L), momentum);
+    double H_prop = -log_post_prop + (1.0 / 2.0) * arma::dot(v, v);
+    accept_prob = std::isfinite(H_prop) ? std::min(1.0, exp(H_actual - H_prop)) : 0.0;
+  }
+  
+  if(runif_0_1(rng_device) < accept_prob) {
+    beta_g = theta_prop.head(p).t();
+    phi_g = exp(theta_prop(p));
+  }
+  
+  double adapt_rate = 1.0 / pow(t + 1.0, 0.55);
+  
+  step_size = exp(log(step_size) + adapt_rate * (accept_prob - HMC_TARGET_ACCEPTANCE));
+  phi_scale += adapt_rate * (phi_g - phi_scale);
+}
+
+template <typename MatType>
+void update_gibbs_parameters_hmc(const int& G, const MatType& X, const arma::vec& y, const arma::ivec& n_groups, const arma::ivec& groups, 
+                                 arma::vec& eta, arma::mat& beta, arma::vec& phi, Philox4x32& rng_device, const int& n_events,
+                                 arma::vec& step_size, arma::vec& phi_scale, const double& t) {
+  arma::uvec indexg;
+  arma::rowvec beta_g;
+  
+  // updating eta
+  eta = rdirichlet(arma::conv_to<arma::Col<double>>::from(n_groups) + 1.5, 
+                   rng_device);
+  
+  // For each g, sample new (beta[g, _], phi[g]) jointly
+  for (int g = 0; g < G; g++) {
+    indexg = arma::find(groups == g);
+    beta_g = beta.row(g);
+    
+    update_group_hmc(beta_g, phi(g), design_rows(X, indexg), y(indexg), count_events(indexg, n_events), step_size(g), phi_scale(g), t, rng_device);
+    
+    beta.row(g) = beta_g;
+  }
+}
+
+// Number of iterations between two full rebuilds of the per-group statistics
+const int GROUP_STATS_REFRESH = 500;
+
+// Number of draws kept by a chain with Niter iterations, after discarding the
+// first warmup ones and keeping one of every thin of the remaining
+int number_of_retained_draws(const int& Niter, const int& warmup, const int& thin) {
+  return (Niter <= warmup) ? 0 : (Niter - warmup + thin - 1) / thin;
+}
+
+// Number of draws kept by a chain from the iteration first_iter (the first
+// one is 0) to first_iter + Niter - 1
+int number_of_retained_draws(const int& first_iter, const int& Niter, const int& warmup, const int& thin) {
+  return number_of_retained_draws(first_iter + Niter, warmup, thin) - number_of_retained_draws(first_iter, warmup, thin);
+}
+
+// Number of retained draws between two checks of the convergence of the chains
+const int CONVERGENCE_CHECK_EVERY = 100;
+
+// State of a chain after its first draws retained in the run, kept while the
+// chains may still stop there
+struct ChainSnapshot {
+  int draws;
+  ChainState state;
+};
+
+// Column of the draws of the sampler (G blocks of betas, phi and eta) in each
+// column of the output: the betas of every component, the G phis and the G
+// etas, the last one being dropped from the output (1 minus the others)
+arma::uvec draws_layout(const int& p, const int& G) {
+  arma::uvec from_output((p + 2) * G);
+
+  for (int g = 0; g < G; g++) {
+    for (int j = 0; j < p; j++) {
+      from_output(g * p + j) = g * (p + 2) + j;
+    }
+
+    from_output(p * G + g) = g * (p + 2) + p;
+    from_output((p + 1) * G + g) = g * (p + 2) + p + 1;
+  }
+
+  return from_output;
+}
+
+// The first n_kept of the n_draws values of each of the n_segments segments
+// of data, as doubles (an R array)
+template <typename eT>
+Rcpp::NumericVector kept_draws(const eT* data, const int& n_draws, const int& n_kept, const int& n_segments) {
+  Rcpp::NumericVector out(static_cast<std::size_t>(n_kept) * n_segments);
+
+  for (int s = 0; s < n_segments; s++) {
+    std::copy(data + static_cast<std::size_t>(s) * n_draws, data + static_cast<std::size_t>(s) * n_draws + n_kept,
+              out.begin() + static_cast<std::size_t>(s) * n_kept);
+  }
+
+  return out;
+}
+
+// Internal implementation of the lognormal mixture model via Gibbs sampler.
+// The retained draws are relabelled online and written on the sink as the
+// chain runs, in the column order of draws_layout. If the monitor is enabled, the order of their
+// components by decreasing eta is recorded there (the monitor reads their
+// values from the sink, which the chain flushes at each checkpoint), the state
+// of the chain is kept on snapshots at each checkpoint where it may still stop
+// and the chain stops as soon as the monitor says so.
+// The data must be partitioned by partition_by_status.
+// If resume, the chain continues from state instead of starting from the EM
+// (or random) initial values. If warm_start, the chain starts from the
+// parameters and adaptive proposals in state, the state of a previous fit,
+// skipping the EM; only the observations with state.groups equal to -1 (the
+// new ones) get initial labels. At the end, the chain state is saved on state.
+// The draws, the chain's copy of X' and its means are stored as eT (float in
+// single precision mode, for dense X), while the statistics of the groups and
+// the parameters are always kept in double.
+template <typename eT, typename MatType>
+void lognormal_mixture_gibbs_implementation(const int& Niter, const int& em_iter, const int& G, 
+                                            const arma::vec& t, const arma::ivec& delta, 
+                                            const MatType& X,
+                                            long long int starting_seed,
+                                            const bool& show_output, const int& chain_num,
+                                            const bool& better_initial_values, const int& Niter_em,
+                                            const int& N_em, const bool& data_augmentation, const bool& hmc,
+                                            const bool& within_chain_parallel,
+                                            const int& warmup, const int& thin, DrawSink<eT>& sink,
+                                            ConvergenceMonitor& monitor, ChainState& state,
+                                            std::vector<ChainSnapshot>& snapshots, const bool& resume,
+                                            const bool& warm_start) {
+  
+  Philox4x32 global_rng;
+  
+  // each chain samples from its own stream of the generator
+  setSeed(starting_seed, chain_num - 1, global_rng);
+  
+  int first_iter = resume ? state.iterations : 0;
   
-  // Calculating number of columns of the output matrix:
   // Each group has p (#cols X) covariates, 1 mixture component and
-  // 1 precision. This implies:
+  // 1 precision, so each draw written on the sink has (p + 2) * G elements.
   int p = X.n_cols;
-  int nColsOutput = (p + 2) * G;
   int N = X.n_rows;
   
   arma::vec y = log(t);
   
-  // The output matrix should have Niter rows (1 row for each iteration) and
-  // nColsOutput columns (1 column for each element).
-  arma::mat out(Niter, nColsOutput);
-  
-  // The order of filling the output matrix matters a lot, since we can
-  // make label switching accidentally. Latter this is going to be defined
-  // so we can always fill the matrix in the correct order (by columns, always).
-  arma::mat Xt = X.t();
-  arma::vec y_aug(N);
+  auto Xt = transpose_design<eT>(X);
+  arma::vec y_aug = y;
+  arma::uvec censored_indexes = arma::find(delta == 0); // finding which observations are censored
+  int n_events = N - censored_indexes.n_elem;
   arma::ivec n_groups(G);
-  arma::mat means(N, G);
+  arma::Mat<eT> means_t(G, N);
   arma::vec sd(G);
+  arma::vec inv_sd(G);
+  arma::vec log_sd(G);
+  arma::vec log_eta(G);
   
   // Starting other new values for MCMC algorithms
   arma::vec eta(G);
   arma::vec phi(G);
   arma::mat beta(G, p);
   arma::ivec groups(N);
+  arma::ivec groups_prev(N);
   arma::vec log_eta_new(G);
+  GroupStats stats;
+  
+  // Per block changes on the group statistics made by the data augmentation
+  int n_blocks_censored = number_of_blocks(censored_indexes.n_elem);
+  arma::cube dXty(p, G, n_blocks_censored);
+  arma::mat dyty(G, n_blocks_censored);
+  long long int block_seed;
   
   arma::rowvec newRow;
+  arma::rowvec relabelledRow;
+  arma::vec label_eta(G);
+  arma::uvec from_output = draws_layout(p, G);
   arma::field<arma::mat> em_params(6);
   
   arma::vec proposal_var_phi(G, arma::fill::value(1.0));
@@ -715,33 +2017,116 @@ arma::mat lognormal_mixture_gibbs_implementation(const int& Niter, const int& em
   arma::vec proposal_var_beta(G, arma::fill::value(1.0));
   arma::vec adapt_rate_beta(G, arma::fill::value(1.0));
   
+  arma::vec hmc_step_size(G, arma::fill::value(0.25));
+  arma::vec hmc_phi_scale(G);
+  
   int step = static_cast<int>(std::ceil(static_cast<double>(Niter) / 10.0));
+  int n_retained = 0; // draws retained in this run
+  Relabeller relabeller(G, p + 2);
 
-  if(em_iter > 0) {
+  if(resume || warm_start) {
+    eta = state.eta;
+    phi = state.phi;
+    beta = state.beta;
+    proposal_var_phi = state.proposal_var_phi;
+    adapt_rate_phi = state.adapt_rate_phi;
+    proposal_var_beta = state.proposal_var_beta;
+    adapt_rate_beta = state.adapt_rate_beta;
+    hmc_step_size = state.hmc_step_size;
+    hmc_phi_scale = state.hmc_phi_scale;
+    
+    if(resume) {
+      relabeller = Relabeller(state.relabel_mean, state.relabel_m2, state.relabel_count);
+      global_rng.set_state(state.rng);
+      groups = state.groups;
+      y_aug(censored_indexes) = state.y_censored;
+      stats.XtX = state.XtX;
+      stats.Xty = state.Xty;
+      stats.yty = state.yty;
+    }
+  } else if(em_iter > 0) {
     // starting EM algorithm to find values close to the MLE
-    em_params = lognormal_mixture_em(em_iter, G, t, delta, X, better_initial_values, N_em, Niter_em, true, false, global_rng);
+    em_params = lognormal_mixture_em(em_iter, G, t, delta, X, better_initial_values, N_em, Niter_em, true, false, global_rng, arma::field<arma::mat>(), 0.0, false);
   } else if(show_output) {
     Rcout << "Skipping EM Algorithm" << "\n";
   }
   
-  for (int iter = 0; iter < Niter; iter++) {
+  // saves the state of the chain after its first iterations, to be able to continue it
+  auto save_state = [&](ChainState& to, const int& iterations) {
+    to.iterations = iterations;
+    global_rng.get_state(to.rng);
+    to.eta = eta;
+    to.phi = phi;
+    to.beta = beta;
+    to.groups = groups;
+    to.y_censored = y_aug(censored_indexes);
+    
+    if(data_augmentation) {
+      to.XtX = stats.XtX;
+      to.Xty = stats.Xty;
+      to.yty = stats.yty;
+    } else {
+      to.XtX.zeros(p, p, G);
+      to.Xty.zeros(p, G);
+      to.yty.zeros(G);
+    }
+    
+    to.proposal_var_phi = proposal_var_phi;
+    to.adapt_rate_phi = adapt_rate_phi;
+    to.proposal_var_beta = proposal_var_beta;
+    to.adapt_rate_beta = adapt_rate_beta;
+    to.hmc_step_size = hmc_step_size;
+    to.hmc_phi_scale = hmc_phi_scale;
+    to.relabel_mean = relabeller.mean();
+    to.relabel_m2 = relabeller.m2();
+    to.relabel_count = relabeller.count();
+  };
+  
+  int iter;
+  
+  for (iter = first_iter; iter < first_iter + Niter; iter++) {
+    // the other chains may have already converged
+    if (!monitor.keep_sampling(chain_num - 1)) {
+      break;
+    }
+    
     // Starting empty objects for Gibbs Sampler
-    if (iter == 0) {
+    if (iter == 0 && warm_start) {
+      first_iter_warm_start(state.groups, eta, beta, phi, G, y, sd, groups, Xt, n_events, global_rng);
+    } else if (iter == 0) {
       first_iter_gibbs(em_params, eta, beta, phi, em_iter, G, y, sd, groups, X, delta, global_rng);
+      hmc_phi_scale = phi;
+    }
+    
+    // (Re)building the per-group statistics of the augmented data
+    if (data_augmentation && (iter % GROUP_STATS_REFRESH == 0)) {
+      build_group_stats(stats, Xt, y_aug, groups, G, within_chain_parallel);
     }
     
-    means = X * beta.t();
+    means_t = gibbs_means(beta, Xt);
     sd = 1.0 / sqrt(phi);
+    inv_sd = sqrt(phi);
+    log_sd = arma::log(sd);
+    log_eta = arma::log(eta);
     
     // Data augmentation (if desired)
     if (data_augmentation) {
-      y_aug = augment(G, y, groups, delta, sd, global_rng, means);
-    } else {
-      y_aug = y;
+      block_seed = rseed_(global_rng);
+      AugmentWorker augment_worker(y, y_aug, groups, censored_indexes, sd, means_t, Xt, dXty, dyty, block_seed);
+      run_tasks(augment_worker, n_blocks_censored, within_chain_parallel);
+      
+      // reducing the changes always in the same order
+      for (int b = 0; b < n_blocks_censored; b++) {
+        stats.Xty += dXty.slice(b);
+        stats.yty += dyty.col(b);
+      }
     }
     
     // Updating Groups
-    sample_groups(G, y_aug, eta, sd, groups, data_augmentation, means, delta, global_rng);
+    groups_prev = groups;
+    block_seed = rseed_(global_rng);
+    SampleGroupsWorker groups_worker(G, y_aug, log_eta, inv_sd, log_sd, groups, data_augmentation, means_t, n_events, block_seed);
+    run_tasks(groups_worker, number_of_blocks(N), within_chain_parallel);
     
     // Computing number of observations allocated at each class
     n_groups = groups_table(G, groups);
@@ -751,51 +2136,91 @@ arma::mat lognormal_mixture_gibbs_implementation(const int& Niter, const int& em
     
     // Updating all parameters
     if(data_augmentation) {
-      update_gibbs_parameters(G, X, y_aug, n_groups, groups, eta, beta, phi, global_rng);
+      update_group_stats(stats, Xt, y_aug, groups_prev, groups, G, within_chain_parallel);
+      update_gibbs_parameters(G, stats, n_groups, eta, beta, phi, global_rng);
+    } else if(hmc) {
+      double t = static_cast<double>(iter);
+      update_gibbs_parameters_hmc(G, X, y, n_groups, groups, eta, beta, phi, global_rng, n_events, hmc_step_size, hmc_phi_scale, t);
     } else {
       double t = static_cast<double>(iter);
-      update_gibbs_parameters_augF(G, X, y, n_groups, groups, eta, beta, phi, global_rng, delta, proposal_var_phi, adapt_rate_phi, proposal_var_beta, adapt_rate_beta, t);
+      update_gibbs_parameters_augF(G, X, y, n_groups, groups, eta, beta, phi, global_rng, n_events, proposal_var_phi, adapt_rate_phi, proposal_var_beta, adapt_rate_beta, t);
     }
     
-    // filling the ith iteration row of the output matrix
+    // filling the row of the retained draws (after the warmup, one of each thin)
     // the order of filling will always be the following:
     
-    // First Mixture: proportion, betas, phi
-    // Second Mixture: proportion, betas, phi
+    // First Mixture: betas, phi, proportion
+    // Second Mixture: betas, phi, proportion
     // ...
-    // Last Mixture: proportion, betas, phi
+    // Last Mixture: betas, phi, proportion
     
-    // arma::uvec sorteta = arma::sort_index(eta, "descend");
-    // beta = beta.rows(sorteta);
-    // phi = phi.rows(sorteta);
-    // eta = eta.rows(sorteta);
+    // with the mixtures in the order of their labels, so the draws written
+    // don't switch labels
     
-    newRow = arma::join_rows(beta.row(0),
-                             phi.row(0),
-                             eta.row(0));
-    for (int g = 1; g < G; g++) {
-      newRow = arma::join_rows(newRow, beta.row(g),
-                               phi.row(g),
-                               eta.row(g));
+    if (iter >= warmup && (iter - warmup) % thin == 0) {
+      newRow = arma::join_rows(beta.row(0),
+                               phi.row(0),
+                               eta.row(0));
+      for (int g = 1; g < G; g++) {
+        newRow = arma::join_rows(newRow, beta.row(g),
+                                 phi.row(g),
+                                 eta.row(g));
+      }
+      
+      relabelledRow = relabeller.relabel(newRow);
+      sink.write(chain_num - 1, relabelledRow.cols(from_output));
+      
+      if (monitor.enabled()) {
+        n_retained++;
+        
+        // the monitor reads the draws up to each checkpoint from the sink
+        if (n_retained % CONVERGENCE_CHECK_EVERY == 0) {
+          sink.flush(chain_num - 1);
+        }
+        
+        for (int g = 0; g < G; g++) {
+          label_eta(g) = relabelledRow(g * (p + 2) + p + 1);
+        }
+        
+        monitor.record(chain_num - 1, arma::sort_index(label_eta, "descend"));
+        
+        // the chain may sample past the checkpoint where the chains stop
+        // before it's evaluated, so it keeps its state there
+        if (monitor.may_stop_at(n_retained)) {
+          int open = monitor.open_checkpoint();
+          
+          while (!snapshots.empty() && snapshots.front().draws < open) {
+            snapshots.erase(snapshots.begin());
+          }
+          
+          snapshots.push_back({n_retained, ChainState()});
+          save_state(snapshots.back().state, iter + 1);
+        }
+      }
     }
     
-    out.row(iter) = newRow;
-    
-    if(((iter + 1) % step == 0) && show_output) {
-      Rcout << "(Chain " << chain_num << ") MCMC Iter: " << iter + 1 << "/" << Niter << "\n";
+    if(((iter + 1 - first_iter) % step == 0) && show_output) {
+      Rcout << "(Chain " << chain_num << ") MCMC Iter: " << iter + 1 << "/" << first_iter + Niter << "\n";
     }
   }
   
+  sink.flush(chain_num - 1);
+  save_state(state, iter);
+  
   if(show_output) {
     Rcout << "Chain " << chain_num << " finished sampling." << "\n";
   }
-  
-  return out;
 }
 
+template <typename eT, typename MatType>
 struct GibbsWorker : public RcppParallel::Worker {
-  const arma::vec& seeds; // starting seeds for each chain
-  arma::cube& out; // store matrix iterations for each chain
+  const long long int& starting_seed; // seed of the generator, each chain uses its own stream
+  DrawSink<eT>& sink; // stores the retained draws of each chain
+  ConvergenceMonitor& monitor; // stops the chains once they converged
+  std::vector<ChainState>& states; // state of each chain, to resume from and to be saved
+  std::vector<std::vector<ChainSnapshot> >& snapshots; // states of each chain where it may stop
+  const bool& resume;
+  const bool& warm_start;
   
   // other parameters used to fit the model
   const int& Niter;
@@ -803,57 +2228,297 @@ struct GibbsWorker : public RcppParallel::Worker {
   const int& G;
   const arma::vec& t;
   const arma::ivec& delta;
-  const arma::mat& X;
+  const MatType& X;
   const bool& show_output;
   const bool& better_initial_values;
   const int& N_em;
   const int& Niter_em;
   const bool& data_augmentation;
+  const bool& hmc;
+  const bool& within_chain_parallel;
+  const int& warmup;
+  const int& thin;
   
   // Creating Worker
-  GibbsWorker(const arma::vec& seeds, arma::cube& out, const int& Niter, const int& em_iter, const int& G, const arma::vec& t,
-              const arma::ivec& delta, const arma::mat& X, const bool& show_output, const bool& better_initial_values,
-              const int& N_em, const int& Niter_em, const bool& data_augmentation) :
-    seeds(seeds), out(out), Niter(Niter), em_iter(em_iter), G(G), t(t), delta(delta), X(X), show_output(show_output), better_initial_values(better_initial_values), N_em(N_em), Niter_em(Niter_em), data_augmentation(data_augmentation) {}
+  GibbsWorker(const long long int& starting_seed, DrawSink<eT>& sink, ConvergenceMonitor& monitor,
+              std::vector<ChainState>& states, std::vector<std::vector<ChainSnapshot> >& snapshots, const bool& resume, const bool& warm_start, const int& Niter, const int& em_iter, const int& G, const arma::vec& t,
+              const arma::ivec& delta, const MatType& X, const bool& show_output, const bool& better_initial_values,
+              const int& N_em, const int& Niter_em, const bool& data_augmentation, const bool& hmc,
+              const bool& within_chain_parallel, const int& warmup, const int& thin) :
+    starting_seed(starting_seed), sink(sink), monitor(monitor), states(states), snapshots(snapshots), resume(resume), warm_start(warm_start), Niter(Niter), em_iter(em_iter), G(G), t(t), delta(delta), X(X), show_output(show_output), better_initial_values(better_initial_values), N_em(N_em), Niter_em(Niter_em), data_augmentation(data_augmentation), hmc(hmc), within_chain_parallel(within_chain_parallel), warmup(warmup), thin(thin) {}
   
   void operator()(std::size_t begin, std::size_t end) {
     for (std::size_t i = begin; i < end; ++i) {
-      usleep(5000 * i); // avoid racing conditions
-      out.slice(i) = lognormal_mixture_gibbs_implementation(Niter, em_iter, G, t, delta, X, seeds(i), show_output, i + 1, better_initial_values, Niter_em, N_em, data_augmentation);
+      lognormal_mixture_gibbs_implementation(Niter, em_iter, G, t, delta, X, starting_seed, show_output, i + 1, better_initial_values, Niter_em, N_em, data_augmentation, hmc, within_chain_parallel, warmup, thin, sink, monitor, states[i], snapshots[i], resume, warm_start);
     }
   }
 };
 
-// Function to call lognormal_mixture_gibbs_implementation with parallellization
+// Function to call lognormal_mixture_gibbs_implementation with parallellization.
+// Only the draws after the warmup, thinned, are kept, stored as eT (float or
+// double), and returned as a posterior::draws_array (iteration x chain x
+// variable, named by variables) without the last eta. In double precision the
+// draws are written straight on that array; they are only copied (once) when
+// stored as float or when the chains stopped early. If draws_file is not
+// empty, they are streamed to that file instead (as a n_draws_max x n_chains x
+// n_cols array of eT, with the last eta as the last variable) and an empty
+// array is returned.
+// If early_stopping, all chains stop once max R-hat < rhat_threshold and
+// min bulk ESS >= ess_threshold; the number of draws kept by each chain is
+// returned, with the number of iterations and the final diagnostics.
+// If resume_from is not empty, the chains continue for Niter more iterations
+// from the checkpoint saved there (with its warmup and thin), and their draws
+// are the ones an uninterrupted run would give. If warm_start_from is not
+// empty, the chains start from the final state saved there by a previous fit,
+// whose observations must be the first rows of the data, and only the new
+// rows get initial labels. If checkpoint_file is not empty, the final state
+// of the chains (at the checkpoint where they stopped, if they stopped early)
+// is saved there.
+template <typename eT, typename MatType>
+Rcpp::List lognormal_mixture_gibbs_fit(const int& Niter, const int& em_iter, const int& G,
+                                       const arma::vec& t, const arma::ivec& delta, 
+                                       const MatType& X, long long int starting_seed,
+                                       const bool& show_output, const int& n_chains,
+                                       const bool& better_initial_values, const int& N_em, const int& Niter_em,
+                                       const bool& data_augmentation, const bool& hmc, const bool& within_chain_parallel,
+                                       const int& warmup, const int& thin, const std::string& draws_file,
+                                       const bool& early_stopping, const double& rhat_threshold, const double& ess_threshold,
+                                       const std::string& checkpoint_file, const std::string& resume_from,
+                                       const std::string& warm_start_from, const Rcpp::CharacterVector& variables) {
+  int n_cols = (X.n_cols + 2) * G;
+  int n_vars = n_cols - 1;
+  int N = X.n_rows;
+  int n_censored = arma::accu(delta == 0);
+  
+  // the chains run on the data partitioned by status; the labels in the
+  // checkpoints are kept in the user's order
+  arma::uvec order = partition_by_status(delta);
+  arma::vec t_part = t(order);
+  arma::ivec delta_part = delta(order);
+  MatType X_part = design_rows(X, order);
+  CheckpointHeader header = {n_chains, G, static_cast<int>(X.n_cols), N, n_censored, warmup, thin,
+                             data_augmentation, hmc, std::is_same<eT, float>::value};
+  std::vector<ChainState> states(n_chains);
+  bool resume = !resume_from.empty();
+  bool warm_start = !warm_start_from.empty();
+  int first_iter = 0;
+  
+  if (variables.size() != n_vars) {
+    Rcpp::stop("There must be one name for each variable of the draws.");
+  }
+  
+  if (resume && warm_start) {
+    Rcpp::stop("The chains can't be both resumed and warm started.");
+  }
+  
+  if (resume) {
+    load_checkpoint(resume_from, header, states, false);
+    first_iter = states[0].iterations;
+    
+    for (int c = 0; c < n_chains; c++) {
+      states[c].groups = states[c].groups(order);
+    }
+  } else if (warm_start) {
+    load_checkpoint(warm_start_from, header, states, true);
+    
+    // the previous fit saw the first rows of the data, the others are new
+    for (int c = 0; c < n_chains; c++) {
+      arma::ivec groups_seen = states[c].groups;
+      
+      states[c].groups.set_size(N);
+      
+      for (int i = 0; i < N; i++) {
+        states[c].groups(i) = (order(i) < groups_seen.n_elem) ? groups_seen(order(i)) : -1;
+      }
+    }
+  }
+  
+  int n_draws = number_of_retained_draws(first_iter, Niter, header.warmup, header.thin);
+  Rcpp::NumericVector out(0); // initializing output object
+  arma::Col<eT> out_eT; // the draws, when they can't be written on out
+  eT* data = NULL;
+  ConvergenceMonitor monitor(early_stopping, n_chains, G, X.n_cols + 2, n_draws, CONVERGENCE_CHECK_EVERY, rhat_threshold, ess_threshold);
+  std::vector<std::vector<ChainSnapshot> > snapshots(n_chains);
+  arma::uvec from_output = draws_layout(X.n_cols, G);
+  arma::uvec to_output = arma::sort_index(from_output);
+  
+  // Runs the chains in parallel, with the monitor reading their draws from
+  // the sink. Once all the chains finished, the chains that sampled past the
+  // checkpoint where they stopped are rolled back to it, so their states
+  // don't depend on how fast each one ran.
+  auto run_chains = [&](DrawSink<eT>& sink) {
+    monitor.read_draws_from([&sink, &to_output](const int& chain, const int& col, const int& n, double* out) {
+      sink.read(chain, to_output(col), n, out);
+    });
+    
+    GibbsWorker worker(starting_seed, sink, monitor, states, snapshots, resume, warm_start, Niter, em_iter, G, t_part, delta_part, X_part, show_output, better_initial_values, N_em, Niter_em, data_augmentation, hmc, within_chain_parallel, header.warmup, header.thin);
+    RcppParallel::parallelFor(0, n_chains, worker);
+    monitor.finish();
+    
+    for (int c = 0; c < n_chains; c++) {
+      for (const ChainSnapshot& snapshot : snapshots[c]) {
+        if (snapshot.draws == monitor.n_draws()) {
+          states[c] = snapshot.state;
+        }
+      }
+      
+      snapshots[c].clear();
+    }
+  };
+  
+  if (draws_file.empty()) {
+    if constexpr (std::is_same<eT, double>::value) {
+      out = Rcpp::NumericVector(static_cast<std::size_t>(n_draws) * n_chains * n_vars);
+      data = out.begin();
+    } else {
+      out_eT.set_size(static_cast<std::size_t>(n_draws) * n_chains * n_vars);
+      data = out_eT.memptr();
+    }
+    
+    DrawSink<eT> sink(data, n_draws, n_cols, n_chains, n_vars);
+    run_chains(sink);
+  } else {
+    DrawSink<eT> sink(draws_file, n_draws, n_cols, n_chains);
+    run_chains(sink);
+  }
+  
+  if (!checkpoint_file.empty()) {
+    for (int c = 0; c < n_chains; c++) {
+      arma::ivec groups_part = states[c].groups;
+      states[c].groups(order) = groups_part;
+    }
+    
+    save_checkpoint(checkpoint_file, header, states);
+  }
+  
+  // the draws after the ones of the checkpoint where the chains stopped are dropped
+  int n_kept = monitor.n_draws();
+  int iterations = first_iter + Niter;
+  
+  if (n_kept < n_draws) {
+    // iteration of the last kept draw
+    int first_retained = header.warmup + header.thin * number_of_retained_draws(first_iter, header.warmup, header.thin);
+    iterations = first_retained + (n_kept - 1) * header.thin + 1;
+  }
+  
+  if (draws_file.empty()) {
+    if (n_kept < n_draws || !std::is_same<eT, double>::value) {
+      out = kept_draws(data, n_draws, n_kept, n_chains * n_vars);
+    }
+    
+    Rcpp::CharacterVector iteration_names(n_kept);
+    Rcpp::CharacterVector chain_names(n_chains);
+    
+    for (int i = 0; i < n_kept; i++) {
+      iteration_names[i] = std::to_string(i + 1);
+    }
+    
+    for (int c = 0; c < n_chains; c++) {
+      chain_names[c] = std::to_string(c + 1);
+    }
+    
+    out.attr("dim") = Rcpp::Dimension(n_kept, n_chains, n_vars);
+    out.attr("dimnames") = Rcpp::List::create(Rcpp::Named("iteration") = iteration_names,
+                                              Rcpp::Named("chain") = chain_names,
+                                              Rcpp::Named("variable") = variables);
+    out.attr("class") = Rcpp::CharacterVector::create("draws_array", "draws", "array");
+  }
+  
+  return Rcpp::List::create(Rcpp::Named("draws") = out,
+                            Rcpp::Named("n_draws") = n_kept,
+                            Rcpp::Named("n_draws_max") = n_draws,
+                            Rcpp::Named("iterations") = iterations,
+                            Rcpp::Named("rhat") = monitor.rhat(),
+                            Rcpp::Named("ess") = monitor.ess());
+}
+
+// Fits the model with lognormal_mixture_gibbs_fit, where X is either a dense
+// matrix or a sparse one (dgCMatrix), which is never densified. If
+// single_precision, a dense X, the means and the draws are stored as float.
+// variables are the names of the variables of the draws.
 // [[Rcpp::export]]
-arma::cube lognormal_mixture_gibbs(const int& Niter, const int& em_iter, const int& G,
+Rcpp::List lognormal_mixture_gibbs(const int& Niter, const int& em_iter, const int& G,
                                    const arma::vec& t, const arma::ivec& delta, 
-                                   const arma::mat& X, const arma::vec& starting_seed,
+                                   SEXP X, long long int starting_seed,
                                    const bool& show_output, const int& n_chains,
                                    const bool& better_initial_values, const int& N_em, const int& Niter_em,
-                                   const bool& data_augmentation) {
-  arma::cube out(Niter, (X.n_cols + 2) * G, n_chains); // initializing output object
+                                   const bool& data_augmentation, const bool& hmc, const bool& within_chain_parallel,
+                                   const int& warmup, const int& thin, const std::string& draws_file,
+                                   const bool& early_stopping, const double& rhat_threshold, const double& ess_threshold,
+                                   const std::string& checkpoint_file, const std::string& resume_from,
+                                   const std::string& warm_start_from, const bool& single_precision,
+                                   const Rcpp::CharacterVector& variables) {
+  return with_design_matrix(X, [&](const auto& X_design) {
+    if constexpr (std::is_same<std::decay_t<decltype(X_design)>, arma::mat>::value) {
+      if (single_precision) {
+        return lognormal_mixture_gibbs_fit<float>(Niter, em_iter, G, t, delta, X_design, starting_seed, show_output, n_chains,
+                                                  better_initial_values, N_em, Niter_em, data_augmentation, hmc, within_chain_parallel,
+                                                  warmup, thin, draws_file, early_stopping, rhat_threshold, ess_threshold,
+                                                  checkpoint_file, resume_from, warm_start_from, variables);
+      }
+    }
+    
+    return lognormal_mixture_gibbs_fit<double>(Niter, em_iter, G, t, delta, X_design, starting_seed, show_output, n_chains,
+                                               better_initial_values, N_em, Niter_em, data_augmentation, hmc, within_chain_parallel,
+                                               warmup, thin, draws_file, early_stopping, rhat_threshold, ess_threshold,
+                                               checkpoint_file, resume_from, warm_start_from, variables);
+  });
+}
+
+// If eta_start is not empty, the EM starts from eta_start, beta_start and
+// phi_start (warm start from a previous fit) instead of searching for initial values.
+// If batch_size > 0, the mini-batch EM is used, with batch_size observations per iteration.
+// Otherwise, tol > 0 stops the EM once the parameters change less than tol
+// (relatively) in an iteration and squarem accelerates it.
+template <typename MatType>
+arma::field<arma::mat> lognormal_mixture_em_fit(const int& Niter, const int& G, const arma::vec& t,
+                                                const arma::ivec& delta, const MatType& X, 
+                                                long long int starting_seed,
+                                                const bool& better_initial_values, const int& N_em,
+                                                const int& Niter_em, const bool& show_output,
+                                                const int& batch_size, const double& tol, const bool& squarem,
+                                                const arma::vec& eta_start, const arma::mat& beta_start,
+                                                const arma::vec& phi_start) {
+  
+  Philox4x32 global_rng;
+  arma::field<arma::mat> start_params;
+  arma::uvec order = partition_by_status(delta);
+  arma::vec t_part = t(order);
+  arma::ivec delta_part = delta(order);
+  MatType X_part = design_rows(X, order);
+  
+  // setting global seed to start the sampler
+  setSeed(starting_seed, global_rng);
+  
+  if (eta_start.n_elem > 0) {
+    start_params.set_size(3);
+    start_params(0) = eta_start;
+    start_params(1) = beta_start;
+    start_params(2) = phi_start;
+  }
+  
+  if (batch_size > 0) {
+    return lognormal_mixture_em_minibatch(Niter, G, t_part, delta_part, X_part, batch_size, better_initial_values, N_em, Niter_em, show_output, global_rng, start_params);
+  }
   
-  // Fitting in parallel
-  GibbsWorker worker(starting_seed, out, Niter, em_iter, G, t, delta, X, show_output, better_initial_values, N_em, Niter_em, data_augmentation);
-  RcppParallel::parallelFor(0, n_chains, worker);
+  arma::field<arma::mat> out = lognormal_mixture_em(Niter, G, t_part, delta_part, X_part, better_initial_values, N_em, Niter_em, false, show_output, global_rng, start_params, tol, squarem);
   
   return out;
 }
 
+// Fits the model with lognormal_mixture_em_fit, where X is either a dense
+// matrix or a sparse one (dgCMatrix), which is never densified.
 //[[Rcpp::export]]
 arma::field<arma::mat> lognormal_mixture_em_implementation(const int& Niter, const int& G, const arma::vec& t,
-                                                           const arma::ivec& delta, const arma::mat& X, 
+                                                           const arma::ivec& delta, SEXP X, 
                                                            long long int starting_seed,
                                                            const bool& better_initial_values, const int& N_em,
-                                                           const int& Niter_em, const bool& show_output) {
-  
-  std::mt19937 global_rng;
-  
-  // setting global seed to start the sampler
-  setSeed(starting_seed, global_rng);
-  
-  arma::field<arma::mat> out = lognormal_mixture_em(Niter, G, t, delta, X, better_initial_values, N_em, Niter_em, false, show_output, global_rng);
-  
-  return out;
+                                                           const int& Niter_em, const bool& show_output,
+                                                           const int& batch_size, const double& tol, const bool& squarem,
+                                                           const arma::vec& eta_start, const arma::mat& beta_start,
+                                                           const arma::vec& phi_start) {
+  return with_design_matrix(X, [&](const auto& X_design) {
+    return lognormal_mixture_em_fit(Niter, G, t, delta, X_design, starting_seed, better_initial_values, N_em, Niter_em,
+                                    show_output, batch_size, tol, squarem, eta_start, beta_start, phi_start);
+  });
 }
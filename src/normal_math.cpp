@@ -0,0 +1,97 @@
+#include <RcppArmadillo.h>
+
+#include "normal_math.hpp"
+
+double normal_quantile(const double& p) {
+  double q = p - 0.5;
+  double r, value;
+
+  if (std::fabs(q) <= 0.425) {
+    r = 0.180625 - q * q;
+
+    return q * (((((((r * 2509.0809287301226727 + 33430.575583588128105) * r + 67265.770927008700853) * r +
+                   45921.953931549871457) * r + 13731.693765509461125) * r + 1971.5909503065514427) * r +
+                 133.14166789178437745) * r + 3.387132872796366608) /
+      (((((((r * 5226.495278852545925 + 28729.085735721942674) * r + 39307.89580009271061) * r +
+           21213.794301586595867) * r + 5394.1960214247511077) * r + 687.1870074920579083) * r +
+         42.313330701600911252) * r + 1.0);
+  }
+
+  // the tails, from r = sqrt(-log(min(p, 1 - p)))
+  r = std::sqrt(-std::log(q < 0.0 ? p : 1.0 - p));
+
+  if (r <= 5.0) {
+    r -= 1.6;
+    value = (((((((r * 7.7454501427834140764e-4 + 0.0227238449892691845833) * r + 0.24178072517745061177) * r +
+                 1.27045825245236838258) * r + 3.64784832476320460504) * r + 5.7694972214606914055) * r +
+               4.6303378461565452959) * r + 1.42343711074968357734) /
+      (((((((r * 1.05075007164441684324e-9 + 5.475938084995344946e-4) * r + 0.0151986665636164571966) * r +
+           0.14810397642748007459) * r + 0.68976733498510000455) * r + 1.6763848301838038494) * r +
+         2.05319162663775882187) * r + 1.0);
+  } else {
+    r -= 5.0;
+    value = (((((((r * 2.01033439929228813265e-7 + 2.71155556874348757815e-5) * r + 0.0012426609473880784386) * r +
+                 0.026532189526576123093) * r + 0.29656057182850489123) * r + 1.7848265399172913358) * r +
+               5.4637849111641143699) * r + 6.6579046435011037772) /
+      (((((((r * 2.04426310338993978564e-15 + 1.4215117583164458887e-7) * r + 1.8463183175100546818e-5) * r +
+           7.868691311456132591e-4) * r + 0.0148753612908506148525) * r + 0.13692988092273580531) * r +
+         0.59983220655588793769) * r + 1.0);
+  }
+
+  return (q < 0.0) ? -value : value;
+}
+
+void normal_log_pdf(const double* z, double* out, const int& n) {
+  for (int j = 0; j < n; j++) {
+    out[j] = -0.5 * z[j] * z[j] - LOG_SQRT_2PI;
+  }
+}
+
+void normal_upper_cdf(const double* z, double* out, const int& n) {
+  for (int j = 0; j < n; j++) {
+    out[j] = 0.5 * std::erfc(z[j] * M_SQRT1_2);
+  }
+}
+
+void normal_log_upper_cdf(const double* z, double* out, const int& n) {
+  for (int j = 0; j < n; j++) {
+    out[j] = normal_log_upper_cdf(z[j]);
+  }
+}
+
+void normal_inverse_mills_ratio(const double* z, double* out, const int& n) {
+  for (int j = 0; j < n; j++) {
+    out[j] = normal_inverse_mills_ratio(z[j]);
+  }
+}
+
+void normal_quantile(const double* p, double* out, const int& n) {
+  for (int j = 0; j < n; j++) {
+    out[j] = normal_quantile(p[j]);
+  }
+}
+
+// The array kernels applied to z, one column each: log-density, upper tail,
+// log of the upper tail and inverse Mills ratio (to test them against R)
+// [[Rcpp::export]]
+arma::mat normal_math_cpp(const arma::vec& z) {
+  int n = z.n_elem;
+  arma::mat out(n, 4);
+
+  normal_log_pdf(z.memptr(), out.colptr(0), n);
+  normal_upper_cdf(z.memptr(), out.colptr(1), n);
+  normal_log_upper_cdf(z.memptr(), out.colptr(2), n);
+  normal_inverse_mills_ratio(z.memptr(), out.colptr(3), n);
+
+  return out;
+}
+
+// The quantile kernel applied to p (to test it against R)
+// [[Rcpp::export]]
+arma::vec normal_quantile_cpp(const arma::vec& p) {
+  arma::vec out(p.n_elem);
+
+  normal_quantile(p.memptr(), out.memptr(), p.n_elem);
+
+  return out;
+}
@@ -1,15 +1,17 @@
 // -*- mode: C++; c-indent-level: 2; c-basic-offset: 2; indent-tabs-mode: nil; -*-
 
 #include <RcppArmadillo.h>
-#include <unistd.h>
-#include <stdio.h>
-#include <stdlib.h>
+#include <RcppParallel.h>
+
+#include "design_matrix.hpp"
+#include "quantiles.hpp"
+#include "normal_math.hpp"
 
 using namespace Rcpp;
 
 // Functions used to predict EM survival
 double sob_lognormal(const double& t, const double& m, const double& sigma) {
-  return R::pnorm((m -log(t))/sigma, 0, 1, true, false);
+  return normal_upper_cdf((log(t) - m) / sigma);
 }
 
 double sob_lognormal_mix(const double& t, const arma::rowvec& m, const arma::vec& sigma, const arma::vec& eta) {
@@ -25,7 +27,7 @@ double hazard_lognormal_mix(const double& t, const arma::rowvec& m, const arma::
   double dlnorm_mix = 0;
 
   for (int i = 0; i < m.n_elem; i++) {
-    dlnorm_mix += eta(i) * R::dlnorm(t, m(i), sigma(i), false);
+    dlnorm_mix += eta(i) * exp(normal_log_pdf((log(t) - m(i)) / sigma(i))) / (t * sigma(i));
   }
   return dlnorm_mix/sob_mix;
 }
@@ -52,128 +54,147 @@ arma::vec predict_hazard_em_cpp(const arma::vec& t, const arma::mat& m, const ar
   return out;
 }
 
-// [[Rcpp::export]]
-arma::mat predict_survival_gibbs_cpp(const arma::vec& eval_time, const arma::rowvec& predictors, const arma::field<arma::mat>& beta_start, const arma::mat sigma_start, const arma::mat eta_start,
-                                     const bool& interval, const double& level) {
-  arma::vec surv(eval_time.n_elem);
-  arma::vec surv_low(eval_time.n_elem);
-  arma::vec surv_high(eval_time.n_elem);
-  
-  int Niter = sigma_start.n_rows;
-  int mixture_components = sigma_start.n_cols;
-  double t;
+// Number of draws evaluated at once by PredictGibbsWorker
+const int PREDICT_BLOCK_SIZE = 256;
+
+// Summary over the draws of the survival (or hazard, if hazard) of the
+// mixture of each row of the new data at every eval time: its mean and, if
+// interval, its quantiles 1 - level and level, in out.slice(row) (one row
+// per eval time). The linear predictors of each row (G x draws) are computed
+// when the row is predicted, from beta_t (one p x n_draws matrix per
+// component), so only the ones of the rows being predicted are kept.
+// The quantiles are found by selection or, if streaming, estimated with P²
+// as the draws are evaluated, without keeping them. The draws are evaluated
+// in blocks of PREDICT_BLOCK_SIZE, with the array kernels of normal_math.hpp
+// on their standardized log-times (G x draws, as sigma_t and eta_t).
+template <typename MatType>
+struct PredictGibbsWorker : public RcppParallel::Worker {
+  const arma::vec& eval_time;
+  const DesignRows<MatType>& predictors;
+  const arma::field<arma::mat>& beta_t;
+  const arma::mat& sigma_t;
+  const arma::mat& eta_t;
+  const bool& hazard;
+  const bool& interval;
+  const arma::vec& levels;
+  const bool& streaming;
+  arma::cube& out;
   
-  arma::vec levels = { 1.0 - level, level };
-  arma::vec quantiles(2);
-  
-  arma::vec surv_pred(Niter);  
-  arma::rowvec sigma;
-  arma::rowvec eta;
-  arma::mat beta(mixture_components, beta_start(0).n_cols);
-  arma::mat beta_mat(Niter, beta_start(0).n_cols);
-  arma::rowvec m;
-  arma::mat eta_mat = arma::join_rows(eta_start,  arma::zeros<arma::vec>(eta_start.n_rows));
+  PredictGibbsWorker(const arma::vec& eval_time, const DesignRows<MatType>& predictors, const arma::field<arma::mat>& beta_t,
+                     const arma::mat& sigma_t, const arma::mat& eta_t, const bool& hazard, const bool& interval,
+                     const arma::vec& levels, const bool& streaming, arma::cube& out) :
+    eval_time(eval_time), predictors(predictors), beta_t(beta_t), sigma_t(sigma_t), eta_t(eta_t), hazard(hazard), interval(interval), levels(levels), streaming(streaming), out(out) {}
   
-  for(int time = 0; time < eval_time.n_elem; time++) {
-    t = eval_time(time);
-
-    for(int i = 0; i < Niter; i++) {
-      // completing the eta_matrix
-      eta_mat(i, mixture_components - 1) = 1 - arma::sum(eta_start.row(i));
+  void operator()(std::size_t begin, std::size_t end) {
+    int Niter = sigma_t.n_cols;
+    int mixture_components = sigma_t.n_rows;
+    arma::vec pred(streaming ? 0 : Niter);
+    arma::rowvec x_row;
+    arma::mat m(mixture_components, Niter);
+    arma::mat z(mixture_components, PREDICT_BLOCK_SIZE);
+    arma::mat surv_c(mixture_components, PREDICT_BLOCK_SIZE);
+    arma::rowvec value(PREDICT_BLOCK_SIZE);
+    double t, log_t, total;
+    int n_block, last;
+    
+    for (std::size_t r = begin; r < end; r++) {
+      predictors.read(r, x_row);
       
-      for(int c = 0; c < mixture_components; c++) {
-        beta_mat = beta_start(c);
-        beta.row(c) = beta_mat.row(i);
+      for (int c = 0; c < mixture_components; c++) {
+        m.row(c) = x_row * beta_t(c);
       }
       
-      m = predictors * beta.t();
-      eta = eta_mat.row(i);
-      sigma = sigma_start.row(i);
-      
-      surv_pred(i) = sob_lognormal_mix(t, m, sigma.t(), eta.t());
-    }
-
-    surv(time) = arma::mean(surv_pred);
-    
-    if(interval) {
-      quantiles = arma::quantile(surv_pred, levels);
-      
-      surv_low(time) = quantiles(0);
-      surv_high(time) = quantiles(1);
+      for (arma::uword time = 0; time < eval_time.n_elem; time++) {
+        t = eval_time(time);
+        log_t = log(t);
+        total = 0.0;
+        P2Quantile lower(levels(0));
+        P2Quantile upper(levels(1));
+        
+        for (int first = 0; first < Niter; first += PREDICT_BLOCK_SIZE) {
+          n_block = std::min(PREDICT_BLOCK_SIZE, Niter - first);
+          last = first + n_block - 1;
+          
+          // standardized log-time in each component of each draw of the block
+          z.head_cols(n_block) = (log_t - m.cols(first, last)) / sigma_t.cols(first, last);
+          normal_upper_cdf(z.memptr(), surv_c.memptr(), mixture_components * n_block);
+          value.head(n_block) = arma::sum(eta_t.cols(first, last) % surv_c.head_cols(n_block), 0);
+          
+          if (hazard) {
+            normal_log_pdf(z.memptr(), z.memptr(), mixture_components * n_block);
+            value.head(n_block) = arma::sum(eta_t.cols(first, last) % arma::exp(z.head_cols(n_block)) / sigma_t.cols(first, last), 0) /
+              (t * value.head(n_block));
+          }
+          
+          total += arma::accu(value.head(n_block));
+          
+          if (!streaming) {
+            pred.subvec(first, last) = value.head(n_block).t();
+          } else if (interval) {
+            for (int i = 0; i < n_block; i++) {
+              lower.add(value(i));
+              upper.add(value(i));
+            }
+          }
+        }
+        
+        out(time, 0, r) = total / Niter;
+        
+        if (interval && streaming) {
+          out(time, 1, r) = lower.quantile();
+          out(time, 2, r) = upper.quantile();
+        } else if (interval) {
+          out(time, 1, r) = quantile_select(pred.memptr(), Niter, levels(0));
+          out(time, 2, r) = quantile_select(pred.memptr(), Niter, levels(1));
+        }
+      }
     }
   }
-
-  arma::mat out;
-  
-  if(interval) {
-    
-    out = arma::join_rows(surv, arma::join_rows(surv_low, surv_high));
-  } else {
-    out = surv;
-  }
-
-  return out;
-}
-
-// [[Rcpp::export]]
-arma::mat predict_hazard_gibbs_cpp(const arma::vec& eval_time, const arma::rowvec& predictors, const arma::field<arma::mat>& beta_start, const arma::mat sigma_start, const arma::mat eta_start,
-                                     const bool& interval, const double& level) {
-  arma::vec surv(eval_time.n_elem);
-  arma::vec surv_low(eval_time.n_elem);
-  arma::vec surv_high(eval_time.n_elem);
-  
-  int Niter = sigma_start.n_rows;
-  int mixture_components = sigma_start.n_cols;
-  double t;
-  
+};
+
+// Predicts the survival (or hazard, if hazard) of every row of predictors at
+// every eval time, from the draws of beta (one n_draws x p matrix per
+// component), sigma and eta (without its last component). Returns an
+// n_times x (1 or 3) x n_rows array with the mean over the draws and, if
+// interval, the quantiles 1 - level and level (estimated with P², without
+// keeping the draws of each eval time, if streaming). The rows are predicted
+// in parallel, each one computing its own linear predictors, so the memory
+// used doesn't grow with the number of rows (besides the output).
+template <typename MatType>
+arma::cube predict_gibbs_fit(const arma::vec& eval_time, const MatType& predictors, const arma::field<arma::mat>& beta,
+                             const arma::mat& sigma, const arma::mat& eta_start, const bool& hazard,
+                             const bool& interval, const double& level, const bool& streaming) {
+  int Niter = sigma.n_rows;
+  int mixture_components = sigma.n_cols;
+  int n_rows = predictors.n_rows;
   arma::vec levels = { 1.0 - level, level };
-  arma::vec quantiles(2);
+  arma::field<arma::mat> beta_t(mixture_components);
+  arma::cube out(eval_time.n_elem, interval ? 3 : 1, n_rows);
   
-  arma::vec surv_pred(Niter);  
-  arma::rowvec sigma;
-  arma::rowvec eta;
-  arma::mat beta(mixture_components, beta_start(0).n_cols);
-  arma::mat beta_mat(Niter, beta_start(0).n_cols);
-  arma::rowvec m;
-  arma::mat eta_mat = arma::join_rows(eta_start,  arma::zeros<arma::vec>(eta_start.n_rows));
+  // completing the eta matrix
+  arma::mat eta = arma::join_rows(eta_start, 1.0 - arma::sum(eta_start, 1));
   
-  for(int time = 0; time < eval_time.n_elem; time++) {
-    t = eval_time(time);
-
-    for(int i = 0; i < Niter; i++) {
-      // completing the eta_matrix
-      eta_mat(i, mixture_components - 1) = 1 - arma::sum(eta_start.row(i));
-      
-      for(int c = 0; c < mixture_components; c++) {
-        beta_mat = beta_start(c);
-        beta.row(c) = beta_mat.row(i);
-      }
-      
-      m = predictors * beta.t();
-      eta = eta_mat.row(i);
-      sigma = sigma_start.row(i);
-      
-      surv_pred(i) = hazard_lognormal_mix(t, m, sigma.t(), eta.t());
-    }
-
-    surv(time) = arma::mean(surv_pred);
-    
-    if(interval) {
-      quantiles = arma::quantile(surv_pred, levels);
-      
-      surv_low(time) = quantiles(0);
-      surv_high(time) = quantiles(1);
-    }
+  for (int c = 0; c < mixture_components; c++) {
+    beta_t(c) = beta(c).t(); // p x n_draws
   }
-
-  arma::mat out;
   
-  if(interval) {
-    
-    out = arma::join_rows(surv, arma::join_rows(surv_low, surv_high));
-  } else {
-    out = surv;
-  }
-
+  arma::mat sigma_t = sigma.t();
+  arma::mat eta_t = eta.t();
+  
+  DesignRows<MatType> predictors_rows(predictors);
+  PredictGibbsWorker<MatType> worker(eval_time, predictors_rows, beta_t, sigma_t, eta_t, hazard, interval, levels, streaming, out);
+  RcppParallel::parallelFor(0, n_rows, worker);
+  
   return out;
 }
+
+// Calls predict_gibbs_fit with the new data, either a dense matrix or a
+// sparse one (dgCMatrix).
+// [[Rcpp::export]]
+arma::cube predict_gibbs_cpp(const arma::vec& eval_time, SEXP predictors, const arma::field<arma::mat>& beta,
+                             const arma::mat& sigma, const arma::mat& eta, const bool& hazard,
+                             const bool& interval, const double& level, const bool& streaming) {
+  return with_design_matrix(predictors, [&](const auto& X) {
+    return predict_gibbs_fit(eval_time, X, beta, sigma, eta, hazard, interval, level, streaming);
+  });
+}
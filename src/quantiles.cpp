@@ -0,0 +1,128 @@
+#include "quantiles.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+double quantile_select(double* x, const int& n, const double& p) {
+  double alpha = 0.5;
+  double N = n;
+
+  if (n == 0) {
+    return arma::datum::nan;
+  }
+
+  if (p <= (1.0 - alpha) / N) {
+    return *std::min_element(x, x + n);
+  }
+
+  if (p >= (N - alpha) / N) {
+    return *std::max_element(x, x + n);
+  }
+
+  // interpolating between the k-th and (k + 1)-th smallest values (1-based)
+  int k = static_cast<int>(std::floor(N * p + alpha));
+  double w = (p - (k - alpha) / N) * N;
+
+  std::nth_element(x, x + k - 1, x + n);
+
+  double lower = x[k - 1];
+  double upper = *std::min_element(x + k, x + n); // all of them are >= lower
+
+  return (1.0 - w) * lower + w * upper;
+}
+
+P2Quantile::P2Quantile(const double& p) : p(p), count(0) {
+  increments[0] = 0.0;
+  increments[1] = p / 2.0;
+  increments[2] = p;
+  increments[3] = (1.0 + p) / 2.0;
+  increments[4] = 1.0;
+}
+
+void P2Quantile::add(const double& x) {
+  int k;
+
+  // the first 5 values are the initial markers
+  if (count < 5) {
+    heights[count] = x;
+    count++;
+
+    if (count == 5) {
+      std::sort(heights, heights + 5);
+
+      for (int i = 0; i < 5; i++) {
+        positions[i] = i + 1;
+      }
+
+      desired[0] = 1.0;
+      desired[1] = 1.0 + 2.0 * p;
+      desired[2] = 1.0 + 4.0 * p;
+      desired[3] = 3.0 + 2.0 * p;
+      desired[4] = 5.0;
+    }
+
+    return;
+  }
+
+  // cell k where x falls, extending the extreme markers if needed
+  if (x < heights[0]) {
+    heights[0] = x;
+    k = 0;
+  } else if (x >= heights[4]) {
+    heights[4] = x;
+    k = 3;
+  } else {
+    k = 0;
+
+    while (x >= heights[k + 1]) {
+      k++;
+    }
+  }
+
+  for (int i = k + 1; i < 5; i++) {
+    positions[i]++;
+  }
+
+  for (int i = 0; i < 5; i++) {
+    desired[i] += increments[i];
+  }
+
+  count++;
+
+  // adjusting the heights of the middle markers
+  for (int i = 1; i < 4; i++) {
+    double d = desired[i] - positions[i];
+
+    if ((d >= 1.0 && positions[i + 1] - positions[i] > 1.0) ||
+        (d <= -1.0 && positions[i - 1] - positions[i] < -1.0)) {
+      d = (d > 0.0) ? 1.0 : -1.0;
+      heights[i] = moved_height(i, d);
+      positions[i] += d;
+    }
+  }
+}
+
+double P2Quantile::moved_height(const int& i, const double& d) const {
+  double parabolic = heights[i] + d / (positions[i + 1] - positions[i - 1]) *
+    ((positions[i] - positions[i - 1] + d) * (heights[i + 1] - heights[i]) / (positions[i + 1] - positions[i]) +
+     (positions[i + 1] - positions[i] - d) * (heights[i] - heights[i - 1]) / (positions[i] - positions[i - 1]));
+
+  if (heights[i - 1] < parabolic && parabolic < heights[i + 1]) {
+    return parabolic;
+  }
+
+  int j = i + static_cast<int>(d);
+
+  return heights[i] + d * (heights[j] - heights[i]) / (positions[j] - positions[i]);
+}
+
+double P2Quantile::quantile() const {
+  if (count >= 5) {
+    return heights[2];
+  }
+
+  double values[5];
+  std::copy(heights, heights + count, values);
+
+  return quantile_select(values, count, p);
+}
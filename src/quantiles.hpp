@@ -0,0 +1,37 @@
+#ifndef QUANTILES_HPP
+#define QUANTILES_HPP
+
+#include <RcppArmadillo.h>
+
+// Quantile p of the n values at x, with the definition of arma::quantile
+// (definition 5 of Hyndman and Fan, 1996), found by selection (expected
+// linear time) instead of sorting. The values at x are reordered.
+double quantile_select(double* x, const int& n, const double& p);
+
+// Streaming estimate of the quantile p of a sequence of values with the P²
+// algorithm (Jain and Chlamtac, 1985), which only keeps 5 markers, whatever
+// the length of the sequence. While it has seen 5 values or less, the
+// quantile is exact.
+class P2Quantile {
+public:
+  P2Quantile(const double& p);
+
+  // Updates the markers with the next value of the sequence
+  void add(const double& x);
+
+  double quantile() const;
+
+private:
+  double p;
+  int count;
+  double heights[5];
+  double positions[5];
+  double desired[5];
+  double increments[5];
+
+  // Marker i moved by d (1 or -1) positions, with the piecewise-parabolic
+  // formula or, if it leaves the heights out of order, the linear one
+  double moved_height(const int& i, const double& d) const;
+};
+
+#endif
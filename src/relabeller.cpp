@@ -0,0 +1,124 @@
+#include "relabeller.hpp"
+
+#include <vector>
+
+Relabeller::Relabeller(const int& G, const int& n_params) :
+  G(G), n_params(n_params), mean_(n_params, G, arma::fill::zeros), m2_(n_params, G, arma::fill::zeros), count_(0) {}
+
+Relabeller::Relabeller(const arma::mat& mean, const arma::mat& m2, const int& count) :
+  G(mean.n_cols), n_params(mean.n_rows), mean_(mean), m2_(m2), count_(count) {}
+
+arma::rowvec Relabeller::relabel(const arma::rowvec& draw) {
+  arma::mat components = arma::reshape(draw, n_params, G); // one column per component
+  arma::mat relabelled(n_params, G);
+  arma::uvec labels(G);
+
+  if (count_ == 0) {
+    // the first draw sets the labels, by decreasing eta
+    arma::uvec order = arma::stable_sort_index(components.row(n_params - 1), "descend");
+
+    for (int k = 0; k < G; k++) {
+      labels(order(k)) = k;
+    }
+  } else {
+    arma::mat cost(G, G);
+    arma::vec inv_var(n_params, arma::fill::ones); // a single draw has no variance yet
+
+    for (int l = 0; l < G; l++) {
+      if (count_ > 1) {
+        inv_var = 1.0 / (m2_.col(l) / (count_ - 1.0) + 1e-10);
+      }
+
+      for (int g = 0; g < G; g++) {
+        cost(g, l) = arma::accu(arma::square(components.col(g) - mean_.col(l)) % inv_var);
+      }
+    }
+
+    labels = min_cost_assignment(cost);
+  }
+
+  for (int g = 0; g < G; g++) {
+    relabelled.col(labels(g)) = components.col(g);
+  }
+
+  // updating the running moments of each label (Welford)
+  count_++;
+  arma::mat delta = relabelled - mean_;
+  mean_ += delta / count_;
+  m2_ += delta % (relabelled - mean_);
+
+  return arma::vectorise(relabelled, 1);
+}
+
+// Shortest augmenting path version of the Hungarian algorithm, O(n^3), with
+// the potentials u (rows) and v (columns) and 1-based indexes (0 is a dummy
+// column holding the row being assigned)
+arma::uvec min_cost_assignment(const arma::mat& cost) {
+  int n = cost.n_rows;
+  arma::uvec assigned(n);
+
+  if (!cost.is_finite()) {
+    return arma::regspace<arma::uvec>(0, n - 1);
+  }
+
+  arma::vec u(n + 1, arma::fill::zeros);
+  arma::vec v(n + 1, arma::fill::zeros);
+  arma::vec min_v(n + 1);
+  arma::uvec row_of(n + 1, arma::fill::zeros); // row assigned to each column
+  arma::uvec way(n + 1, arma::fill::zeros);
+  std::vector<bool> used(n + 1);
+
+  for (int i = 1; i <= n; i++) {
+    arma::uword j0 = 0;
+    row_of(0) = i;
+    min_v.fill(arma::datum::inf);
+    std::fill(used.begin(), used.end(), false);
+
+    do {
+      used[j0] = true;
+      arma::uword i0 = row_of(j0);
+      arma::uword j1 = 0;
+      double delta = arma::datum::inf;
+
+      for (int j = 1; j <= n; j++) {
+        if (!used[j]) {
+          double reduced = cost(i0 - 1, j - 1) - u(i0) - v(j);
+
+          if (reduced < min_v(j)) {
+            min_v(j) = reduced;
+            way(j) = j0;
+          }
+
+          if (min_v(j) < delta) {
+            delta = min_v(j);
+            j1 = j;
+          }
+        }
+      }
+
+      for (int j = 0; j <= n; j++) {
+        if (used[j]) {
+          u(row_of(j)) += delta;
+          v(j) -= delta;
+        } else {
+          min_v(j) -= delta;
+        }
+      }
+
+      j0 = j1;
+    } while (row_of(j0) != 0);
+
+    // flipping the augmenting path
+    do {
+      arma::uword j1 = way(j0);
+      row_of(j0) = row_of(j1);
+      j0 = j1;
+    } while (j0 != 0);
+  }
+
+  for (int j = 1; j <= n; j++) {
+    assigned(row_of(j) - 1) = j - 1;
+  }
+
+  return assigned;
+}
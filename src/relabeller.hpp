@@ -0,0 +1,43 @@
+#ifndef RELABELLER_HPP
+#define RELABELLER_HPP
+
+#include <RcppArmadillo.h>
+
+// Online relabelling of the mixture components of a chain (Celeux, 1998;
+// Stephens, 2000), so its draws leave the sampler without label switching.
+// Each draw has G blocks of n_params values, one per component, and its
+// components are assigned to the labels whose running means (of the draws
+// already relabelled) are the closest, each parameter scaled by its running
+// variance. The last parameter of each block must be the proportion eta.
+// The first draw sets the labels, by decreasing eta, and the draws already
+// relabelled are never reordered, so a chain continued from the running
+// moments of a previous run relabels its draws as an uninterrupted one.
+class Relabeller {
+public:
+  Relabeller(const int& G, const int& n_params);
+
+  // Continues the relabelling of a previous run, with its running moments
+  Relabeller(const arma::mat& mean, const arma::mat& m2, const int& count);
+
+  // Returns the draw with its blocks in the order of their labels
+  arma::rowvec relabel(const arma::rowvec& draw);
+
+  // Running moments of the parameters of each label (n_params x G), where
+  // m2 is the sum of squared deviations (Welford), and the number of draws
+  const arma::mat& mean() const { return mean_; }
+  const arma::mat& m2() const { return m2_; }
+  int count() const { return count_; }
+
+private:
+  int G;
+  int n_params;
+  arma::mat mean_;
+  arma::mat m2_;
+  int count_;
+};
+
+// Assignment of rows to columns of the square matrix cost with minimum total
+// cost (Hungarian algorithm): returns the column assigned to each row
+arma::uvec min_cost_assignment(const arma::mat& cost);
+
+#endif
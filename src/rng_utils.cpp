@@ -1,31 +1,121 @@
 #include "rng_utils.hpp"
 
 // Function used to set a seed
-void setSeed(const long long int& seed, std::mt19937& rng_device) {
-  rng_device.seed(seed);
+void setSeed(const long long int& seed, Philox4x32& rng_device) {
+  rng_device.seed(static_cast<uint64_t>(seed), 0);
 }
 
-// Generates a random observation from Uniform(0, 1) 
-double runif_0_1(std::mt19937& rng_device) {
-  std::uniform_real_distribution<double> dist(0.0, 1.0);
-  return dist(rng_device);
+// Function used to set the seed of the stream-th independent stream derived
+// from seed. Used to give each chain and each block of observations its own
+// generator. The stream 0 is the same as setSeed(seed, rng_device).
+void setSeed(const long long int& seed, const long long int& stream, Philox4x32& rng_device) {
+  rng_device.seed(static_cast<uint64_t>(seed), static_cast<uint64_t>(stream));
 }
 
-// Generates a random observation from Normal(mu, sd^2)
-double rnorm_(const double& mu, const double& sd, std::mt19937& rng_device) {
-  std::normal_distribution<double> dist(mu, sd);
-  return dist(rng_device);
+// Advances the generator n 32-bit outputs without computing them
+void skipAhead(const unsigned long long int& n, Philox4x32& rng_device) {
+  rng_device.discard(n);
 }
 
-// Generates a random observation from Gamma(alpha, beta), with mean alpha/beta
-double rgamma_(const double& alpha, const double& beta, std::mt19937& rng_device) {
-  std::gamma_distribution<double> dist(alpha, 1.0 / beta);
-  return dist(rng_device);
+// Draws a non-negative 63-bit seed, used to key new streams
+long long int rseed_(Philox4x32& rng_device) {
+  uint64_t high = rng_device();
+  uint64_t low = rng_device();
+  return static_cast<long long int>(((high << 32) | low) >> 1);
+}
+
+// Generates a random observation from Uniform(0, 1), using 53 random bits
+double runif_0_1(Philox4x32& rng_device) {
+  uint32_t a = rng_device() >> 5;
+  uint32_t b = rng_device() >> 6;
+  return (a * 67108864.0 + b) * (1.0 / 9007199254740992.0);
+}
+
+// Generates a random integer uniformly from {0, 1, ..., n - 1}
+int runif_index(const int& n, Philox4x32& rng_device) {
+  int out = static_cast<int>(runif_0_1(rng_device) * n);
+  return (out < n) ? out : n - 1;
+}
+
+// Generates a random observation from Normal(mu, sd^2) with the Box-Muller
+// transform. The second normal of the pair is discarded, so each draw always
+// consumes the same amount of the stream.
+double rnorm_(const double& mu, const double& sd, Philox4x32& rng_device) {
+  double u1 = 1.0 - runif_0_1(rng_device); // in (0, 1]
+  double u2 = runif_0_1(rng_device);
+  return mu + sd * std::sqrt(-2.0 * std::log(u1)) * std::cos(2.0 * M_PI * u2);
+}
+
+// Generates a random observation from Normal(mu, sd^2) truncated to (lower, Inf).
+// For a standardized bound alpha <= 0 the normal itself is used as proposal,
+// with acceptance rate of at least 1/2. Otherwise, the proposal is the
+// translated exponential of Robert (1995) with optimal rate, whose acceptance
+// rate is above 0.76 however far in the tail the bound is.
+double rtruncnorm_lower_(const double& mu, const double& sd, const double& lower, Philox4x32& rng_device) {
+  double alpha = (lower - mu) / sd;
+  double z;
+  
+  if (alpha <= 0.0) {
+    do {
+      z = rnorm_(0.0, 1.0, rng_device);
+    } while (z <= alpha);
+  } else {
+    double lambda = 0.5 * (alpha + std::sqrt(alpha * alpha + 4.0));
+    
+    while (true) {
+      z = alpha - std::log(1.0 - runif_0_1(rng_device)) / lambda;
+      
+      if (std::log(1.0 - runif_0_1(rng_device)) <= -0.5 * (z - lambda) * (z - lambda)) {
+        break;
+      }
+    }
+  }
+  
+  return mu + sd * z;
+}
+
+// Generates a random observation from Normal(mu, sd^2) truncated to (-Inf, upper)
+double rtruncnorm_upper_(const double& mu, const double& sd, const double& upper, Philox4x32& rng_device) {
+  return -rtruncnorm_lower_(-mu, sd, -upper, rng_device);
+}
+
+// Generates a random observation from Gamma(alpha, beta), with mean alpha/beta,
+// using Marsaglia and Tsang (2000) method
+double rgamma_(const double& alpha, const double& beta, Philox4x32& rng_device) {
+  if (alpha < 1.0) {
+    // boosting: if X ~ Gamma(alpha + 1) and U ~ Uniform(0, 1), X * U^(1/alpha) ~ Gamma(alpha)
+    double u = 1.0 - runif_0_1(rng_device);
+    return rgamma_(alpha + 1.0, beta, rng_device) * std::pow(u, 1.0 / alpha);
+  }
+
+  double d = alpha - 1.0 / 3.0;
+  double c = 1.0 / std::sqrt(9.0 * d);
+  double x, v, u;
+
+  while (true) {
+    do {
+      x = rnorm_(0.0, 1.0, rng_device);
+      v = 1.0 + c * x;
+    } while (v <= 0.0);
+
+    v = v * v * v;
+    u = runif_0_1(rng_device);
+
+    if (u < 1.0 - 0.0331 * x * x * x * x) {
+      break;
+    }
+
+    if (std::log(u) < 0.5 * x * x + d * (1.0 - v + std::log(v))) {
+      break;
+    }
+  }
+
+  return d * v / beta;
 }
 
 // Sample one value (k-dimensional) from a 
 // Dirichlet(alpha_1, alpha_2, ..., alpha_k)
-arma::vec rdirichlet(const arma::vec& alpha, std::mt19937& rng_device) {
+arma::vec rdirichlet(const arma::vec& alpha, Philox4x32& rng_device) {
   int K = alpha.n_elem;
   arma::vec sample(K);
   
@@ -38,7 +128,7 @@ arma::vec rdirichlet(const arma::vec& alpha, std::mt19937& rng_device) {
 }
 
 // Generates a random observation from a MultivariateNormal(mean, covariance)
-arma::vec rmvnorm(const arma::vec& mean, const arma::mat& covariance, std::mt19937& rng_device) {
+arma::vec rmvnorm(const arma::vec& mean, const arma::mat& covariance, Philox4x32& rng_device) {
   int numDims = mean.n_elem;
   arma::vec sample(numDims);
   
@@ -53,3 +143,34 @@ arma::vec rmvnorm(const arma::vec& mean, const arma::mat& covariance, std::mt199
   sample = mean + L * Z;
   return sample;
 }
+
+// Generates a random observation from a MultivariateNormal(Q^{-1} b, Q^{-1}),
+// parameterised by the precision matrix Q, with a single Cholesky factorization
+// Q = L L'. Since the mean solves L L' mean = b and L'^{-1} z ~ N(0, Q^{-1}) for
+// z ~ N(0, I), the sample is L'^{-1} (L^{-1} b + z) and Q is never inverted.
+// Returns false, without drawing, if Q is not numerically positive definite,
+// which is checked on the diagonal of L (its squared ratio bounds the
+// reciprocal condition number of Q from above).
+bool rmvnorm_precision(arma::vec& sample, const arma::vec& b, const arma::mat& precision, Philox4x32& rng_device) {
+  int numDims = b.n_elem;
+  arma::mat L;
+  
+  if (!arma::chol(L, precision, "lower")) {
+    return false;
+  }
+  
+  arma::vec L_diag = L.diag();
+  
+  if (!L_diag.is_finite() || L_diag.min() <= 1e-8 * L_diag.max()) {
+    return false;
+  }
+  
+  arma::vec w = arma::solve(arma::trimatl(L), b);
+  
+  for (int j = 0; j < numDims; j++) {
+    w(j) += rnorm_(0.0, 1.0, rng_device);
+  }
+  
+  sample = arma::solve(arma::trimatu(L.t()), w);
+  return true;
+}
@@ -2,18 +2,158 @@
 #define RNG_UTILS_HPP
 
 #include <RcppArmadillo.h>
-#include <random>
+#include <cstdint>
 
-void setSeed(const long long int& seed, std::mt19937& rng_device);
+// Counter-based Philox4x32-10 generator (Salmon et al., 2011, "Parallel random
+// numbers: as easy as 1, 2, 3"). Each output block is a keyed bijection of a
+// 128-bit counter, so the whole state is the key, the counter and the current
+// block. The two high words of the counter identify the stream and the two
+// low words the position inside it, which makes stream derivation and
+// skip-ahead O(1) and the output independent of how work is scheduled.
+class Philox4x32 {
+public:
+  typedef uint32_t result_type;
 
-double runif_0_1(std::mt19937& rng_device);
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return 0xFFFFFFFF; }
 
-double rnorm_(const double& mu, const double& sd, std::mt19937& rng_device);
+  Philox4x32() {
+    seed(0, 0);
+  }
 
-double rgamma_(const double& alpha, const double& beta, std::mt19937& rng_device);
+  // Starts the stream-th stream of the generator keyed by key
+  void seed(const uint64_t& key, const uint64_t& stream) {
+    k[0] = static_cast<uint32_t>(key);
+    k[1] = static_cast<uint32_t>(key >> 32);
+    c[0] = 0;
+    c[1] = 0;
+    c[2] = static_cast<uint32_t>(stream);
+    c[3] = static_cast<uint32_t>(stream >> 32);
+    index = 4;
+  }
 
-arma::vec rdirichlet(const arma::vec& alpha, std::mt19937& rng_device);
+  result_type operator()() {
+    if (index == 4) {
+      next_block();
+      index = 0;
+    }
 
-arma::vec rmvnorm(const arma::vec& mean, const arma::mat& covariance, std::mt19937& rng_device);
+    return out[index++];
+  }
+
+  // Advances the generator as if n outputs had been drawn
+  void discard(const uint64_t& n) {
+    uint64_t consumed = position() * 4 - (4 - index) + n;
+    uint64_t block = consumed / 4;
+    int rem = static_cast<int>(consumed % 4);
+
+    c[0] = static_cast<uint32_t>(block);
+    c[1] = static_cast<uint32_t>(block >> 32);
+    index = 4;
+
+    if (rem != 0) {
+      next_block();
+      index = rem;
+    }
+  }
+
+  // Full state, in the order key (2 words), counter (4 words) and index
+  void get_state(uint32_t* state) const {
+    state[0] = k[0];
+    state[1] = k[1];
+
+    for (int j = 0; j < 4; j++) {
+      state[2 + j] = c[j];
+    }
+
+    state[6] = static_cast<uint32_t>(index);
+  }
+
+  void set_state(const uint32_t* state) {
+    k[0] = state[0];
+    k[1] = state[1];
+
+    for (int j = 0; j < 4; j++) {
+      c[j] = state[2 + j];
+    }
+
+    index = static_cast<int>(state[6]);
+
+    // regenerating the block being consumed
+    if (index < 4) {
+      uint64_t block = position() - 1;
+      c[0] = static_cast<uint32_t>(block);
+      c[1] = static_cast<uint32_t>(block >> 32);
+      next_block();
+    }
+  }
+
+  static const int state_size = 7;
+
+private:
+  uint32_t k[2];
+  uint32_t c[4];
+  uint32_t out[4];
+  int index; // next output of out to be returned, 4 if exhausted
+
+  uint64_t position() const {
+    return (static_cast<uint64_t>(c[1]) << 32) | c[0];
+  }
+
+  // Computes the block of the current counter and moves to the next position
+  void next_block() {
+    uint32_t x[4] = {c[0], c[1], c[2], c[3]};
+    uint32_t k0 = k[0];
+    uint32_t k1 = k[1];
+    uint64_t p0, p1;
+
+    for (int r = 0; r < 10; r++) {
+      p0 = static_cast<uint64_t>(0xD2511F53) * x[0];
+      p1 = static_cast<uint64_t>(0xCD9E8D57) * x[2];
+
+      x[0] = static_cast<uint32_t>(p1 >> 32) ^ x[1] ^ k0;
+      x[1] = static_cast<uint32_t>(p1);
+      x[2] = static_cast<uint32_t>(p0 >> 32) ^ x[3] ^ k1;
+      x[3] = static_cast<uint32_t>(p0);
+
+      k0 += 0x9E3779B9;
+      k1 += 0xBB67AE85;
+    }
+
+    for (int j = 0; j < 4; j++) {
+      out[j] = x[j];
+    }
+
+    uint64_t block = position() + 1;
+    c[0] = static_cast<uint32_t>(block);
+    c[1] = static_cast<uint32_t>(block >> 32);
+  }
+};
+
+void setSeed(const long long int& seed, Philox4x32& rng_device);
+
+void setSeed(const long long int& seed, const long long int& stream, Philox4x32& rng_device);
+
+void skipAhead(const unsigned long long int& n, Philox4x32& rng_device);
+
+long long int rseed_(Philox4x32& rng_device);
+
+double runif_0_1(Philox4x32& rng_device);
+
+int runif_index(const int& n, Philox4x32& rng_device);
+
+double rnorm_(const double& mu, const double& sd, Philox4x32& rng_device);
+
+double rtruncnorm_lower_(const double& mu, const double& sd, const double& lower, Philox4x32& rng_device);
+
+double rtruncnorm_upper_(const double& mu, const double& sd, const double& upper, Philox4x32& rng_device);
+
+double rgamma_(const double& alpha, const double& beta, Philox4x32& rng_device);
+
+arma::vec rdirichlet(const arma::vec& alpha, Philox4x32& rng_device);
+
+arma::vec rmvnorm(const arma::vec& mean, const arma::mat& covariance, Philox4x32& rng_device);
+
+bool rmvnorm_precision(arma::vec& sample, const arma::vec& b, const arma::mat& precision, Philox4x32& rng_device);
 
 #endif